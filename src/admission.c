@@ -0,0 +1,190 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "admission.h"
+#include "response.h"
+#include "metrics.h"
+
+// 按客户端IP计数的散列桶数，不同IP落在同一个桶时共用一个计数
+#define IP_BUCKETS 65536
+// 判断排队延迟的时间窗口（微秒）
+#define SHED_INTERVAL 100000
+// 拒绝连接时最多读出的已到达数据
+#define SHED_DRAIN 4
+
+// 所有进程共享的连接计数，fork()之前创建
+typedef struct {
+    int total;
+    int per_ip[IP_BUCKETS];
+} admission_counts;
+
+static admission_counts *counts;
+static int max_total;
+static int max_per_ip;
+// 排队延迟的上限（微秒），0表示不检查
+static long long max_delay;
+
+// 每个事件循环线程各自判断是否过载：当前窗口的开始时间、窗口内最短的一轮处理耗时、本轮开始和上一轮结束的时间，
+// 以及本轮中拒绝连接花费的时间
+static __thread long long window_start;
+static __thread long long window_min;
+static __thread long long batch_start;
+static __thread long long batch_end;
+static __thread long long batch_shed;
+static __thread int overloaded;
+
+static long long now_us(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int* ip_counter(const struct sockaddr_in *addr){
+    unsigned int h = ntohl(addr->sin_addr.s_addr) * 2654435761u;
+
+    return &counts->per_ip[h >> 16];
+}
+
+void admission_init(server *serv) {
+    config *conf = serv->conf;
+
+    max_total = conf->max_connections;
+    max_per_ip = conf->max_connections_per_ip;
+    max_delay = (long long) conf->shed_queue_delay * 1000;
+
+    if (!max_total && !max_per_ip)
+        return;
+
+    counts = mmap(NULL, sizeof(*counts), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counts == MAP_FAILED) {
+        perror("mmap");
+        log_error(serv, "mmap: %s", strerror(errno));
+        exit(1);
+    }
+}
+
+// 拒绝连接：已经到达的请求先读出，避免关闭时内核因为未读的数据发送RST使客户端收不到响应，
+// 发送不下时直接放弃，不为被拒绝的连接等待
+static void shed(server *serv, int sockfd, int reason){
+    char buf[4096];
+    struct iovec iov[2];
+    struct msghdr msg;
+    const char *body;
+    size_t head_len, body_len;
+    long long start = max_delay ? now_us() : 0;
+
+    metrics_shed(reason);
+
+    for (int i = 0; i < SHED_DRAIN; i++) {
+        if (recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+            break;
+    }
+
+    // 头部中的Date需要替换为当前时间，复制到buf中，错误页面直接从预先生成的内存发送
+    if ((head_len = http_response_error_head(serv, 503, buf, sizeof(buf), &body, &body_len)) > 0) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = head_len;
+        iov[1].iov_base = (void *) body;
+        iov[1].iov_len = body_len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        sendmsg(sockfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    close(sockfd);
+
+    if (max_delay)
+        batch_shed += now_us() - start;
+}
+
+int admission_admit(server *serv, int sockfd, const struct sockaddr_in *addr) {
+    int *ip = NULL;
+
+    if (overloaded) {
+        shed(serv, sockfd, METRICS_SHED_QUEUE_DELAY);
+        return 0;
+    }
+
+    if (!counts)
+        return 1;
+
+    // 先加再检查，多个进程同时接受连接时也不会超过上限
+    if (__atomic_add_fetch(&counts->total, 1, __ATOMIC_RELAXED) > max_total && max_total) {
+        __atomic_sub_fetch(&counts->total, 1, __ATOMIC_RELAXED);
+        shed(serv, sockfd, METRICS_SHED_MAX_CONNECTIONS);
+        return 0;
+    }
+
+    if (max_per_ip) {
+        ip = ip_counter(addr);
+        if (__atomic_add_fetch(ip, 1, __ATOMIC_RELAXED) > max_per_ip) {
+            __atomic_sub_fetch(ip, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&counts->total, 1, __ATOMIC_RELAXED);
+            shed(serv, sockfd, METRICS_SHED_PER_IP);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void admission_release(const struct sockaddr_in *addr) {
+    if (!counts)
+        return;
+
+    __atomic_sub_fetch(&counts->total, 1, __ATOMIC_RELAXED);
+    if (max_per_ip)
+        __atomic_sub_fetch(ip_counter(addr), 1, __ATOMIC_RELAXED);
+}
+
+void admission_batch_begin(void) {
+    if (!max_delay)
+        return;
+
+    batch_start = now_us();
+    batch_shed = 0;
+
+    // 事件循环空闲等待过一个窗口以上，说明没有积压
+    if (batch_start - batch_end > SHED_INTERVAL)
+        overloaded = 0;
+}
+
+// 与CoDel相同，只看窗口内最短的一轮处理耗时：偶尔一轮处理很久只是突发，
+// 整个窗口内每一轮都超过上限时新到达的事件一直在排队，此时拒绝新连接直到恢复。
+// 拒绝连接的时间不算在内，否则过载时大量拒绝连接本身会使事件循环一直无法恢复
+void admission_batch_end(server *serv) {
+    long long elapsed;
+
+    if (!max_delay)
+        return;
+
+    batch_end = now_us();
+    elapsed = batch_end - batch_start - batch_shed;
+
+    if (batch_end - window_start < SHED_INTERVAL) {
+        if (elapsed < window_min)
+            window_min = elapsed;
+        return;
+    }
+
+    if (window_start && (window_min > max_delay) != overloaded) {
+        overloaded = !overloaded;
+        if (overloaded)
+            log_info(serv, "queue delay %lld us over %lld us, shedding new connections", window_min, max_delay);
+        else
+            log_info(serv, "queue delay back to %lld us, accepting new connections", window_min);
+    }
+
+    window_start = batch_end;
+    window_min = elapsed;
+}
@@ -0,0 +1,22 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+
+#include "server.h"
+
+// 创建所有进程共享的连接计数，max-connections和max-connections-per-ip都为0时不计数
+void admission_init(server *serv);
+
+// 决定是否接受一个新连接：连接总数或同一IP的连接数达到上限，或当前事件循环排队延迟过高时，
+// 发送预先生成的503响应后关闭socket并返回0；接受时计数并返回1
+int admission_admit(server *serv, int sockfd, const struct sockaddr_in *addr);
+
+// 接受的连接关闭时减少计数
+void admission_release(const struct sockaddr_in *addr);
+
+// 事件循环每轮处理开始和结束时调用，按处理耗时判断是否过载
+void admission_batch_begin(void);
+void admission_batch_end(server *serv);
+
+#endif
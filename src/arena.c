@@ -0,0 +1,101 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+// 分配的对齐大小
+#define ARENA_ALIGN (2 * sizeof(void *))
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+arena* arena_init(size_t block_size) {
+    arena *a;
+
+    a = malloc(sizeof(*a));
+    memset(a, 0, sizeof(*a));
+    a->block_size = block_size;
+
+    return a;
+}
+
+void arena_free(arena *a) {
+    arena_block *b, *next;
+
+    if (!a) return;
+
+    for (b = a->head; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+
+    free(a);
+}
+
+// 在当前块之后加入一个至少能放下size字节的新块
+static arena_block* add_block(arena *a, size_t size){
+    arena_block *b;
+
+    if (size < a->block_size)
+        size = a->block_size;
+
+    b = malloc(sizeof(*b) + size);
+    b->size = size;
+
+    if (a->cur) {
+        b->next = a->cur->next;
+        a->cur->next = b;
+    } else {
+        b->next = a->head;
+        a->head = b;
+    }
+
+    return b;
+}
+
+void* arena_alloc(arena *a, size_t size) {
+    void *p;
+
+    size = ALIGN_UP(size);
+
+    // 当前块放不下时依次使用重置前留下的块，都放不下再申请新块
+    while (!a->cur || a->pos + size > a->cur->size) {
+        if (a->cur && a->cur->next && a->cur->next->size >= size)
+            a->cur = a->cur->next;
+        else
+            a->cur = add_block(a, size);
+        a->pos = 0;
+    }
+
+    p = a->cur->data + a->pos;
+    a->pos += size;
+    a->last = p;
+
+    return p;
+}
+
+void* arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size) {
+    size_t off;
+    void *p;
+
+    if (!ptr)
+        return arena_alloc(a, new_size);
+
+    // 最近一次分配后面就是空闲空间，可以直接扩展
+    if (ptr == a->last) {
+        off = (char *) ptr - a->cur->data;
+        if (off + ALIGN_UP(new_size) <= a->cur->size) {
+            a->pos = off + ALIGN_UP(new_size);
+            return ptr;
+        }
+    }
+
+    p = arena_alloc(a, new_size);
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+
+    return p;
+}
+
+void arena_reset(arena *a) {
+    a->cur = a->head;
+    a->pos = 0;
+    a->last = NULL;
+}
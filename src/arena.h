@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// 内存区中的一块
+typedef struct arena_block {
+    struct arena_block *next;
+    // data的大小
+    size_t size;
+    char data[];
+} arena_block;
+
+// 内存区分配器：从大块内存中顺序分配，不单独释放，重置时一次性回收
+// 用于生命周期与一个请求相同的小对象，同一内存区只能被一个线程使用
+typedef struct arena {
+    // 已分配的所有块，重置后保留以便复用
+    arena_block *head;
+    // 当前分配所在的块和其中已使用的字节数
+    arena_block *cur;
+    size_t pos;
+    // 最近一次分配的地址，只有它可以原地扩展
+    void *last;
+    // 新块的默认大小
+    size_t block_size;
+} arena;
+
+// 初始化内存区，第一次分配时才申请内存
+arena* arena_init(size_t block_size);
+
+// 释放内存区和所有块
+void arena_free(arena *a);
+
+// 分配size字节，按指针大小的两倍对齐
+void* arena_alloc(arena *a, size_t size);
+
+// 把ptr处old_size字节的分配扩展到new_size，ptr是最近一次分配且空间足够时原地扩展
+void* arena_realloc(arena *a, void *ptr, size_t old_size, size_t new_size);
+
+// 回收所有分配，保留已申请的块，时间复杂度O(1)
+void arena_reset(arena *a);
+
+#endif
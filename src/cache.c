@@ -0,0 +1,276 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "cache.h"
+
+// 初始哈希桶数量，必须是2的幂
+#define CACHE_INIT_BUCKETS 256
+
+// FNV-1a哈希
+static unsigned int hash_path(const char *path){
+    unsigned int h = 2166136261u;
+
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+// 缓存项占用的字节数
+static size_t entry_bytes(cache_entry *e){
+    return e->size + strlen(e->path) + 1 + sizeof(*e);
+}
+
+static void entry_free(cache_entry *e){
+    free(e->path);
+    free(e->body);
+    free(e->head[0]);
+    free(e->head[1]);
+    free(e);
+}
+
+static void lru_unlink(file_cache *cache, cache_entry *e){
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(file_cache *cache, cache_entry *e){
+    e->prev = NULL;
+    e->next = cache->head;
+
+    if (cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+
+    if (!cache->tail)
+        cache->tail = e;
+}
+
+// 从哈希表和LRU链表中移除，仍在发送中的项延迟到引用释放时回收
+static void remove_entry(file_cache *cache, cache_entry *e){
+    cache_entry **pp = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    lru_unlink(cache, e);
+    cache->count--;
+    cache->bytes -= entry_bytes(e);
+    e->evicted = 1;
+
+    if (e->refcount == 0)
+        entry_free(e);
+}
+
+// 哈希表装载因子超过1时扩容
+static void grow_buckets(file_cache *cache){
+    size_t n = cache->nbuckets * 2;
+    cache_entry **buckets = calloc(n, sizeof(*buckets));
+    cache_entry *e, *next;
+
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        for (e = cache->buckets[i]; e; e = next) {
+            next = e->hnext;
+            e->hnext = buckets[e->hash & (n - 1)];
+            buckets[e->hash & (n - 1)] = e;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = n;
+}
+
+file_cache* cache_init(size_t max_bytes, size_t max_file_size, int revalidate) {
+    file_cache *cache;
+
+    cache = malloc(sizeof(*cache));
+    memset(cache, 0, sizeof(*cache));
+
+    cache->nbuckets = CACHE_INIT_BUCKETS;
+    cache->buckets = calloc(cache->nbuckets, sizeof(*cache->buckets));
+    cache->max_bytes = max_bytes;
+    cache->max_file_size = max_file_size;
+    cache->revalidate = revalidate;
+
+    return cache;
+}
+
+void cache_free(file_cache *cache) {
+    if (!cache) return;
+
+    cache_clear(cache);
+
+    free(cache->buckets);
+    free(cache);
+}
+
+static cache_entry* find_entry(file_cache *cache, const char *path, unsigned int hash){
+    cache_entry *e;
+
+    for (e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+// 缓存项超过有效期时用stat()确认文件没有改变
+static int entry_valid(file_cache *cache, cache_entry *e){
+    struct stat st;
+    time_t now;
+
+    if (cache->revalidate < 0)
+        return 1;
+
+    now = time(NULL);
+    if (now - e->validated < cache->revalidate)
+        return 1;
+
+    if (stat(e->path, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_mtime != e->mtime || st.st_size != e->size ||
+        st.st_ino != e->ino || st.st_dev != e->dev)
+        return 0;
+
+    e->validated = now;
+    return 1;
+}
+
+cache_entry* cache_lookup(file_cache *cache, const char *path) {
+    unsigned int hash = hash_path(path);
+    cache_entry *e = find_entry(cache, path, hash);
+
+    if (e && !entry_valid(cache, e)) {
+        remove_entry(cache, e);
+        e = NULL;
+    }
+
+    if (!e) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    lru_unlink(cache, e);
+    lru_push_front(cache, e);
+    e->refcount++;
+
+    return e;
+}
+
+// 读入整个文件，文件在读取过程中被截断时返回-1
+static int read_body(int fd, char *buf, off_t size){
+    off_t off = 0;
+    ssize_t n;
+
+    while (off < size) {
+        n = pread(fd, buf + off, size - off, off);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        off += n;
+    }
+
+    return 0;
+}
+
+cache_entry* cache_insert(file_cache *cache, const char *path, int fd, const struct stat *st, const char *mime) {
+    cache_entry *e;
+    size_t need;
+
+    if (st->st_size > cache->max_file_size)
+        return NULL;
+
+    need = st->st_size + strlen(path) + 1 + sizeof(*e);
+    if (need > cache->max_bytes)
+        return NULL;
+
+    e = malloc(sizeof(*e));
+    memset(e, 0, sizeof(*e));
+    e->size = st->st_size;
+    e->body = malloc(e->size > 0 ? e->size : 1);
+
+    if (read_body(fd, e->body, e->size) == -1) {
+        free(e->body);
+        free(e);
+        return NULL;
+    }
+
+    e->path = strdup(path);
+    e->hash = hash_path(path);
+    e->mtime = st->st_mtime;
+    e->ino = st->st_ino;
+    e->dev = st->st_dev;
+    e->mime = mime;
+    e->validated = time(NULL);
+
+    // 替换同一路径的旧项
+    cache_invalidate(cache, path);
+
+    // 按LRU顺序淘汰直到放得下新项
+    while (cache->tail && cache->bytes + need > cache->max_bytes) {
+        remove_entry(cache, cache->tail);
+        cache->evictions++;
+    }
+
+    if (cache->count >= cache->nbuckets)
+        grow_buckets(cache);
+
+    e->hnext = cache->buckets[e->hash & (cache->nbuckets - 1)];
+    cache->buckets[e->hash & (cache->nbuckets - 1)] = e;
+    lru_push_front(cache, e);
+    cache->count++;
+    cache->bytes += need;
+    e->refcount = 1;
+
+    return e;
+}
+
+void cache_invalidate(file_cache *cache, const char *path) {
+    cache_entry *e = find_entry(cache, path, hash_path(path));
+
+    if (e)
+        remove_entry(cache, e);
+}
+
+void cache_invalidate_dir(file_cache *cache, const char *dir) {
+    size_t len = strlen(dir);
+    cache_entry *e, *next;
+
+    for (e = cache->head; e; e = next) {
+        next = e->next;
+        if (strncmp(e->path, dir, len) == 0 && e->path[len] == '/')
+            remove_entry(cache, e);
+    }
+}
+
+void cache_clear(file_cache *cache) {
+    while (cache->head)
+        remove_entry(cache, cache->head);
+}
+
+void cache_release(cache_entry *e) {
+    if (!e) return;
+
+    if (--e->refcount == 0 && e->evicted)
+        entry_free(e);
+}
@@ -0,0 +1,92 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// ETag和HTTP日期字符串的缓冲区大小
+#define CACHE_ETAG_SIZE 64
+#define CACHE_DATE_SIZE 32
+
+// 缓存中的一个文件
+typedef struct cache_entry {
+    // 文件的真实路径，作为缓存的键
+    char *path;
+    // 路径的哈希值
+    unsigned int hash;
+    // 文件内容
+    char *body;
+    // 文件大小
+    off_t size;
+    // 文件的修改时间和标识，用于判断文件是否改变
+    time_t mtime;
+    ino_t ino;
+    dev_t dev;
+    // MimeType
+    const char *mime;
+    // ETag和Last-Modified头部的值，由响应模块在加入缓存时生成一次
+    char etag[CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+    // 发送整个文件时的状态行和全部头部，由响应模块生成，[0]关闭连接，[1]保持连接，
+    // 其中Date的值在发送时替换为当前时间
+    char *head[2];
+    size_t head_len[2];
+    // 最近一次确认缓存有效的时间
+    time_t validated;
+    // 正在使用该缓存项的响应数量
+    int refcount;
+    // 已从缓存中移除，引用计数归零时释放
+    int evicted;
+    // 哈希桶中的下一项
+    struct cache_entry *hnext;
+    // LRU链表，表头为最近使用的项
+    struct cache_entry *prev;
+    struct cache_entry *next;
+} cache_entry;
+
+// 文件内容缓存，哈希表加LRU链表，同一缓存只能被一个线程使用
+typedef struct file_cache {
+    cache_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    // 缓存占用的字节数和上限
+    size_t bytes;
+    size_t max_bytes;
+    // 可以缓存的单个文件大小上限
+    size_t max_file_size;
+    // 缓存项经过多少秒后需要stat()重新确认，-1表示永不过期
+    int revalidate;
+    cache_entry *head;
+    cache_entry *tail;
+    // 统计信息
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} file_cache;
+
+// 初始化缓存
+file_cache* cache_init(size_t max_bytes, size_t max_file_size, int revalidate);
+
+// 释放缓存，仍被引用的项在释放引用时才会被回收
+void cache_free(file_cache *cache);
+
+// 查找缓存项，命中时增加引用计数并返回，否则返回NULL
+cache_entry* cache_lookup(file_cache *cache, const char *path);
+
+// 从已打开的文件读入内容并加入缓存，成功时返回增加了引用计数的缓存项
+cache_entry* cache_insert(file_cache *cache, const char *path, int fd, const struct stat *st, const char *mime);
+
+// 移除路径对应的缓存项
+void cache_invalidate(file_cache *cache, const char *path);
+
+// 移除目录dir下的所有缓存项
+void cache_invalidate_dir(file_cache *cache, const char *dir);
+
+// 清空缓存
+void cache_clear(file_cache *cache);
+
+// 释放对缓存项的引用
+void cache_release(cache_entry *e);
+
+#endif
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <stddef.h>
 
 #include "stringutils.h"
 #include "config.h"
@@ -14,6 +15,39 @@ config* config_init() {
     conf = malloc(sizeof(*conf));
     memset(conf, 0, sizeof(*conf));
 
+    // prefork进程池默认值
+    conf->workers = 4;
+    conf->min_spare_workers = 2;
+    conf->max_spare_workers = 8;
+    conf->max_workers = 64;
+
+    // threads模式默认每个CPU一个线程并绑定CPU
+    conf->threads = 0;
+    conf->cpu_pinning = 1;
+
+    // 文件内容缓存默认64MB，只缓存1MB以内的文件
+    conf->cache_size = 64 * 1024;
+    conf->cache_max_file_size = 1024;
+    conf->cache_revalidate = 2;
+    conf->cache_watch = 1;
+
+    // 持久连接默认空闲5秒后关闭，最多处理100个请求
+    conf->keepalive_timeout = 5;
+    conf->keepalive_requests = 100;
+
+    // 慢速客户端：10秒内没有发来数据或没有发完头部、10秒内发送没有进展时关闭连接
+    conf->first_byte_timeout = 10;
+    conf->header_timeout = 10;
+    conf->send_timeout = 10;
+    conf->send_min_rate = 0;
+
+    // 监听队列足够应付突发的连接，响应已经用MSG_MORE合并，不需要Nagle算法
+    conf->listen_backlog = 1024;
+    conf->tcp_nodelay = 1;
+
+    // 默认不限制连接数，拒绝连接时建议客户端1秒后重试
+    conf->retry_after = 1;
+
     return conf;
 }
 
@@ -22,6 +56,86 @@ void config_free(config *conf) {
     free(conf);
 }
 
+int config_parse_mode(const char *name) {
+    if (strcasecmp(name, "fork") == 0)
+        return SERVER_MODE_FORK;
+    else if (strcasecmp(name, "epoll") == 0)
+        return SERVER_MODE_EPOLL;
+    else if (strcasecmp(name, "prefork") == 0)
+        return SERVER_MODE_PREFORK;
+    else if (strcasecmp(name, "threads") == 0)
+        return SERVER_MODE_THREADS;
+    else if (strcasecmp(name, "uring") == 0)
+        return SERVER_MODE_URING;
+    return -1;
+}
+
+// 整数配置项与配置结构中字段的对应关系
+typedef struct {
+    // 配置项名称
+    const char *key;
+    // 字段在config结构中的偏移
+    size_t offset;
+    // 允许的最小值
+    int min;
+} int_option;
+
+static const int_option int_options[] = {
+    {"workers", offsetof(config, workers), 1},
+    {"min-spare-workers", offsetof(config, min_spare_workers), 0},
+    {"max-spare-workers", offsetof(config, max_spare_workers), 1},
+    {"max-workers", offsetof(config, max_workers), 1},
+    {"threads", offsetof(config, threads), 0},
+    {"cpu-pinning", offsetof(config, cpu_pinning), 0},
+    {"cache-size", offsetof(config, cache_size), 0},
+    {"cache-max-file-size", offsetof(config, cache_max_file_size), 0},
+    {"cache-revalidate", offsetof(config, cache_revalidate), 0},
+    {"cache-watch", offsetof(config, cache_watch), 0},
+    {"keepalive-timeout", offsetof(config, keepalive_timeout), 0},
+    {"keepalive-requests", offsetof(config, keepalive_requests), 1},
+    {"first-byte-timeout", offsetof(config, first_byte_timeout), 0},
+    {"header-timeout", offsetof(config, header_timeout), 0},
+    {"send-timeout", offsetof(config, send_timeout), 0},
+    {"send-min-rate", offsetof(config, send_min_rate), 0},
+    {"log-buffer", offsetof(config, log_buffer), 0},
+    {"metrics-port", offsetof(config, metrics_port), 0},
+    {"listen-backlog", offsetof(config, listen_backlog), 1},
+    {"tcp-nodelay", offsetof(config, tcp_nodelay), 0},
+    {"tcp-defer-accept", offsetof(config, tcp_defer_accept), 0},
+    {"tcp-fastopen", offsetof(config, tcp_fastopen), 0},
+    {"send-buffer", offsetof(config, send_buffer), 0},
+    {"recv-buffer", offsetof(config, recv_buffer), 0},
+    {"busy-poll", offsetof(config, busy_poll), 0},
+    {"tcp-keepalive-idle", offsetof(config, tcp_keepalive_idle), 0},
+    {"tcp-keepalive-interval", offsetof(config, tcp_keepalive_interval), 0},
+    {"tcp-keepalive-count", offsetof(config, tcp_keepalive_count), 0},
+    {"max-connections", offsetof(config, max_connections), 0},
+    {"max-connections-per-ip", offsetof(config, max_connections_per_ip), 0},
+    {"shed-queue-delay", offsetof(config, shed_queue_delay), 0},
+    {"retry-after", offsetof(config, retry_after), 0}
+};
+
+// 查找整数配置项，不存在返回NULL
+static const int_option* find_int_option(const char *key){
+    for (size_t i = 0; i < sizeof(int_options) / sizeof(int_options[0]); i++) {
+        if (strcasecmp(key, int_options[i].key) == 0)
+            return &int_options[i];
+    }
+    return NULL;
+}
+
+// 解析整数配置项，成功返回0
+static int parse_int_option(config *conf, const int_option *opt, const char *value){
+    char *end;
+    long n = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || n < opt->min || n > INT_MAX)
+        return -1;
+
+    *(int *) ((char *) conf + opt->offset) = n;
+    return 0;
+}
+
 void config_load(config *conf, const char *fn) {
     char *errormsg;
     struct stat st;
@@ -33,6 +147,8 @@ void config_load(config *conf, const char *fn) {
     int lineno = 0;
     int is_str = 0;
     char ch;
+    int mode;
+    const int_option *opt;
 
     // 打开文件
     fp = fopen(fn, "r");
@@ -85,6 +201,19 @@ void config_load(config *conf, const char *fn) {
                         errormsg = "invalid port"; goto configerr;
                     }        
                 } 
+                //如果key为mode，则获取并发模型
+                else if (strcasecmp(key->ptr, "mode") == 0) {
+                    if ((mode = config_parse_mode(value->ptr)) == -1) {
+                        errormsg = "invalid mode"; goto configerr;
+                    }
+                    conf->mode = mode;
+                }
+                //整数配置项
+                else if ((opt = find_int_option(key->ptr)) != NULL) {
+                    if (parse_int_option(conf, opt, value->ptr) == -1) {
+                        errormsg = "invalid number"; goto configerr;
+                    }
+                }
                 //如果key为document-dir,则获取文件状态
                 else if (strcasecmp(key->ptr, "document-dir") == 0) {
                     if (stat(value->ptr, &st) == 0) {
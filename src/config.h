@@ -2,10 +2,84 @@
 #define CONFIG_H
 
 #include <limits.h>
+
+// 服务器并发模型
+typedef enum {
+    // 每个连接fork()一个子进程
+    SERVER_MODE_FORK,
+    // 单进程边缘触发epoll事件循环
+    SERVER_MODE_EPOLL,
+    // 预先fork的常驻工作进程池，每个进程拥有自己的SO_REUSEPORT监听socket
+    SERVER_MODE_PREFORK,
+    // 每个CPU核心一个事件循环线程，各自拥有监听socket和连接集合
+    SERVER_MODE_THREADS,
+    // 单进程io_uring事件循环，内核不支持时退回到epoll
+    SERVER_MODE_URING
+} server_mode;
+
 // 配置文件数据结构
 typedef struct {
     // 端口号
     short port;
+    // 并发模型
+    server_mode mode;
+    // prefork模式启动时的工作进程数，也是进程池的下限
+    int workers;
+    // prefork模式空闲工作进程数的下限和上限
+    int min_spare_workers;
+    int max_spare_workers;
+    // prefork模式工作进程数的上限
+    int max_workers;
+    // threads模式的事件循环线程数，0表示与在线CPU数相同
+    int threads;
+    // threads模式是否将第i个线程绑定到第i个CPU，并按CPU分发连接
+    int cpu_pinning;
+    // 文件内容缓存大小（KB），0表示不使用缓存
+    int cache_size;
+    // 可以缓存的单个文件大小上限（KB）
+    int cache_max_file_size;
+    // 缓存项经过多少秒后需要重新stat()确认
+    int cache_revalidate;
+    // 是否用inotify监视Web文件目录，监视成功时缓存项不再需要stat()确认
+    int cache_watch;
+    // 持久连接的空闲超时（秒），0表示不保持连接
+    int keepalive_timeout;
+    // 每个持久连接最多处理的请求数
+    int keepalive_requests;
+    // 建立连接后收到第一个字节的期限和从第一个字节起收完请求头部的期限（秒），0表示不限制
+    int first_byte_timeout;
+    int header_timeout;
+    // 发送响应时的检查周期（秒），每个周期内必须有进展且平均速率不低于send_min_rate（字节/秒），0表示不限制
+    int send_timeout;
+    int send_min_rate;
+    // 异步访问日志环形缓冲区的记录数，0表示在请求处理中直接写日志
+    int log_buffer;
+    // 统计接口在本机监听的端口，0表示不统计
+    int metrics_port;
+    // 监听队列长度，超过net.core.somaxconn时由内核截断
+    int listen_backlog;
+    // 是否设置TCP_NODELAY
+    int tcp_nodelay;
+    // TCP_DEFER_ACCEPT的秒数，收到数据后才接受连接，0表示不使用
+    int tcp_defer_accept;
+    // TCP_FASTOPEN的队列长度，0表示不使用
+    int tcp_fastopen;
+    // SO_SNDBUF和SO_RCVBUF的字节数，0表示使用系统默认值
+    int send_buffer;
+    int recv_buffer;
+    // SO_BUSY_POLL的微秒数，0表示不使用
+    int busy_poll;
+    // TCP keepalive探测：空闲多少秒后开始、间隔秒数和次数，idle为0表示不使用，其余为0时使用系统默认值
+    int tcp_keepalive_idle;
+    int tcp_keepalive_interval;
+    int tcp_keepalive_count;
+    // 同时处理的连接总数和每个客户端IP的连接数上限，0表示不限制
+    int max_connections;
+    int max_connections_per_ip;
+    // 事件循环的排队延迟（毫秒）持续超过该值时拒绝新连接，0表示不检查
+    int shed_queue_delay;
+    // 拒绝连接时503响应中Retry-After的秒数
+    int retry_after;
     // Web文件目录
     char doc_root[PATH_MAX];
 } config;
@@ -19,4 +93,7 @@ void config_free(config *conf);
 // 加载配置
 void config_load(config *conf, const char *fn);
 
+// 解析并发模型名称，失败返回-1
+int config_parse_mode(const char *name);
+
 #endif
\ No newline at end of file
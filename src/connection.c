@@ -1,4 +1,9 @@
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <string.h>
@@ -10,6 +15,58 @@
 #include "request.h"
 #include "response.h"
 #include "stringutils.h"
+#include "metrics.h"
+#include "admission.h"
+
+// 单次recv()的缓冲区大小
+#define RECV_CHUNK 512
+// 一次可读事件最多读入接收队列的数据，超过后先处理已有的请求再继续读取，
+// 大于HTTP_REQUEST_SIZE_MAX，读满时接收队列中一定有完整的请求或过长的头部
+#define RECV_BUDGET (64 * 1024)
+// 一次最多处理的流水线请求数，超过后先发送已有的响应
+#define PIPELINE_MAX 32
+// 一次sendmsg()最多合并的数据块数
+#define SEND_IOV_MAX 64
+// 发送队列每次扩展的长度
+#define CHUNKS_SIZE_INC 8
+// 连接内存区每块的大小，一般的请求只需要一块
+#define ARENA_BLOCK_SIZE 4096
+// 一次最多连续拒绝的连接数，过载时客户端不断重连也不会一直停在accept()中
+#define SHED_MAX 64
+
+// 释放数据块持有的文件描述符或缓存引用
+static void release_chunk(send_chunk *c){
+    if (c->shared)
+        return;
+
+    if (c->type == SEND_CHUNK_FILE)
+        close(c->fd);
+    else if (c->type == SEND_CHUNK_MEM)
+        cache_release(c->cached);
+}
+
+// 清空发送队列
+static void clear_send_queue(connection *con){
+    for (size_t i = con->chunk_pos; i < con->nchunks; i++)
+        release_chunk(&con->chunks[i]);
+
+    con->nchunks = 0;
+    con->chunk_pos = 0;
+    string_reset(con->send_buf);
+}
+
+// 发送队列全部发送完，连接开始等待下一个请求
+static void send_queue_done(connection *con){
+    metrics_flushed(con);
+    clear_send_queue(con);
+    con->idle_since = time(NULL);
+}
+
+// 记录当前请求收到第一个字节的时间
+static void mark_request_start(connection *con){
+    if (con->request_start == 0 && con->recv_buf->len > 0)
+        con->request_start = time(NULL);
+}
 
 void connection_close(connection *con) {
     if (!con) return;
@@ -17,32 +74,26 @@ void connection_close(connection *con) {
     // 释放连接对应的请求和相应
     http_request_free(con->request);
     http_response_free(con->response);
-    
+
     // 释放客户端连接中的缓存
+    clear_send_queue(con);
+    free(con->chunks);
     string_free(con->recv_buf);
-    
+    string_free(con->send_buf);
+    arena_free(con->arena);
+
     // 关闭连接socket
     if (con->sockfd > -1)
         close(con->sockfd);
 
+    if (con->admitted)
+        admission_release(&con->addr);
+
     free(con);
 }
 
-connection* connection_accept(server *serv) {
-    //新地址
-    struct sockaddr_in addr;
+connection* connection_new(int sockfd, const struct sockaddr_in *addr) {
     connection *con;
-    int sockfd;
-    socklen_t addr_len = sizeof(addr);
-
-    // accept() 接受新的连接
-    sockfd = accept(serv->sockfd, (struct sockaddr *) &addr, &addr_len);
-    
-    if (sockfd < 0) {
-        log_error(serv, "accept: %s", strerror(errno));
-        perror("accept");
-        return NULL;
-    }
 
     // 创建连接结构实例
     con = malloc(sizeof(*con));
@@ -52,53 +103,587 @@ connection* connection_accept(server *serv) {
     con->request_len = 0;
     con->sockfd = sockfd;
     con->real_path[0] = '\0';
+    con->rel_path = con->real_path;
 
     //接受信息
     con->recv_state = HTTP_RECV_STATE_WORD1;
+    con->state = CON_STATE_READ;
+    con->arena = arena_init(ARENA_BLOCK_SIZE);
     con->request = http_request_init();
-    con->response = http_response_init();
+    con->response = http_response_init(con->arena);
     con->recv_buf = string_init();
-    memcpy(&con->addr, &addr, addr_len);
+    con->send_buf = string_init();
+    con->chunks = NULL;
+    con->nchunks = con->chunks_size = con->chunk_pos = 0;
+    con->keep_alive = 0;
+    con->requests = 0;
+    con->pending = 0;
+    con->idle_since = time(NULL);
+    con->request_start = 0;
+    con->bytes_sent = con->send_mark = 0;
+    con->send_since = 0;
+    con->timer.prev = con->timer.next = NULL;
+    con->admitted = 0;
+    memcpy(&con->addr, addr, sizeof(con->addr));
 
     return con;
 }
 
-int connection_handler(server *serv, connection *con) {
-    char buf[512];
-    int nbytes;
+connection* connection_accept(server *serv, int flags) {
+    //新地址
+    struct sockaddr_in addr;
+    int sockfd;
+    socklen_t addr_len;
+    connection *con;
+    int shed = 0;
+
+    // 被拒绝的连接已经关闭，继续接受下一个
+    do {
+        if (shed++ == SHED_MAX)
+            return NULL;
+
+        // accept() 接受新的连接
+        addr_len = sizeof(addr);
+        sockfd = accept4(serv->sockfd, (struct sockaddr *) &addr, &addr_len, flags);
+
+        if (sockfd < 0) {
+            // 非阻塞监听socket上没有更多的连接，或被信号打断
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return NULL;
+            log_error(serv, "accept: %s", strerror(errno));
+            perror("accept");
+            return NULL;
+        }
+    } while (!admission_admit(serv, sockfd, &addr));
+
+    con = connection_new(sockfd, &addr);
+    con->admitted = 1;
+
+    return con;
+}
+
+static send_chunk* push_chunk(connection *con, send_chunk_type type){
+    send_chunk *c;
+
+    if (con->nchunks >= con->chunks_size) {
+        con->chunks_size += CHUNKS_SIZE_INC;
+        con->chunks = realloc(con->chunks, con->chunks_size * sizeof(send_chunk));
+    }
+
+    c = &con->chunks[con->nchunks++];
+    memset(c, 0, sizeof(*c));
+    c->type = type;
+    c->fd = -1;
+
+    return c;
+}
+
+// 把send_buf中[from, to)的数据加入发送队列
+static void queue_buf(connection *con, size_t from, size_t to){
+    send_chunk *c;
+
+    if (to > from) {
+        c = push_chunk(con, SEND_CHUNK_BUF);
+        c->off = from;
+        c->left = to - from;
+    }
+}
+
+// 把响应内容中的一段加入发送队列，shared为0时文件描述符或缓存引用转移给队列
+static void queue_body(connection *con, off_t off, off_t len, int shared){
+    http_response *resp = con->response;
+    send_chunk *c;
+
+    if (len <= 0)
+        return;
+
+    if (resp->body_mem) {
+        c = push_chunk(con, SEND_CHUNK_MEM);
+        c->mem = resp->body_mem;
+        c->cached = resp->cached;
+        if (!shared)
+            resp->cached = NULL;
+    } else if (resp->body_fd > -1) {
+        c = push_chunk(con, SEND_CHUNK_FILE);
+        c->fd = resp->body_fd;
+        if (!shared)
+            resp->body_fd = -1;
+    } else {
+        return;
+    }
+
+    c->off = off;
+    c->left = len;
+    c->shared = shared;
+}
+
+// 把刚构建好的响应加入发送队列
+static void queue_response(connection *con, size_t head_off){
+    http_response *resp = con->response;
+    size_t pos = head_off;
+
+    if (resp->nranges == 0) {
+        queue_buf(con, head_off, con->send_buf->len);
+        queue_body(con, resp->body_off, resp->body_left, 0);
+    } else {
+        // 多段响应的分段头部和文件内容交替发送，数据块按顺序释放，由最后一段持有文件
+        for (int i = 0; i < resp->nranges; i++) {
+            queue_buf(con, pos, resp->ranges[i].head_end);
+            queue_body(con, resp->ranges[i].off, resp->ranges[i].len, i < resp->nranges - 1);
+            pos = resp->ranges[i].head_end;
+        }
+        queue_buf(con, pos, con->send_buf->len);
+    }
+
+    resp->body_mem = NULL;
+    resp->body_left = 0;
+}
+
+// 请求接收完毕后解析请求，构建响应并加入发送队列
+static void process_request(server *serv, connection *con){
+    config *conf = serv->conf;
+    size_t head_off = con->send_buf->len;
+
+    http_request_parse(serv, con);
+    con->requests++;
+
+    // 无法解析或头部过长的请求之后的数据无法可靠地分帧，只能关闭连接
+    con->keep_alive = conf->keepalive_timeout > 0 &&
+                      con->status_code != 400 && con->status_code != 431 &&
+                      con->requests < conf->keepalive_requests &&
+                      http_request_keep_alive(con->request);
+
+    http_response_build(serv, con);
+    log_request(serv, con);
+    metrics_request(con);
+    queue_response(con, head_off);
+}
+
+// 重置连接上的请求状态，保留接收队列中属于下一个请求的数据
+static void next_request(connection *con){
+    string_consume(con->recv_buf, con->request_len);
+
+    // 剩余的数据属于已经开始的下一个请求
+    con->request_start = 0;
+    mark_request_start(con);
+    con->request_len = 0;
+    con->status_code = 0;
+    con->real_path[0] = '\0';
+    con->rel_path = con->real_path;
+    con->recv_state = HTTP_RECV_STATE_WORD1;
+
+    http_request_reset(con->request);
+    http_response_reset(con->response);
+    arena_reset(con->arena);
+}
+
+// 依次处理接收队列中所有完整的请求，响应都加入发送队列，返回处理的请求数
+static int process_pipeline(server *serv, connection *con){
+    int n = 0;
+
+    while (n < PIPELINE_MAX && http_request_complete(con) != 0) {
+        process_request(serv, con);
+        n++;
+
+        if (!con->keep_alive)
+            break;
+        next_request(con);
+    }
+
+    return n;
+}
+
+// 已发送nbytes字节，推进发送队列
+static void advance_chunks(connection *con, size_t nbytes){
+    send_chunk *c;
+
+    while (nbytes > 0) {
+        c = &con->chunks[con->chunk_pos];
+
+        if (nbytes < c->left) {
+            c->off += nbytes;
+            c->left -= nbytes;
+            return;
+        }
+
+        nbytes -= c->left;
+        c->left = 0;
+        release_chunk(c);
+        con->chunk_pos++;
+    }
+}
+
+int connection_send_iov(connection *con, struct iovec *iov, int max, int *more) {
+    send_chunk *c;
+    size_t i;
+    int n = 0;
+
+    for (i = con->chunk_pos; i < con->nchunks && n < max; i++) {
+        c = &con->chunks[i];
+
+        if (c->type == SEND_CHUNK_FILE)
+            break;
+
+        iov[n].iov_base = (c->type == SEND_CHUNK_BUF ? con->send_buf->ptr : (char *) c->mem) + c->off;
+        iov[n].iov_len = c->left;
+        n++;
+    }
+
+    *more = i < con->nchunks;
+
+    return n;
+}
+
+send_chunk* connection_send_chunk(connection *con) {
+    return con->chunk_pos < con->nchunks ? &con->chunks[con->chunk_pos] : NULL;
+}
+
+int connection_advance(connection *con, size_t nbytes) {
+    con->bytes_sent += nbytes;
+    advance_chunks(con, nbytes);
+
+    if (con->chunk_pos < con->nchunks)
+        return 0;
+
+    send_queue_done(con);
+
+    return 1;
+}
+
+// 把连续的内存数据块合并为一次sendmsg()
+static ssize_t send_mem_chunks(connection *con){
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr msg;
+    int flags = MSG_NOSIGNAL;
+    int more;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = connection_send_iov(con, iov, SEND_IOV_MAX, &more);
+
+    // 后面紧接着还有数据（通常是sendfile()发送的文件内容）时，
+    // 使用MSG_MORE让内核暂缓发送，头部和文件开头可以合并在同一个报文段中
+    if (more)
+        flags |= MSG_MORE;
+
+    // 与send()一样使用MSG_NOSIGNAL，对端关闭时不产生SIGPIPE
+    return sendmsg(con->sockfd, &msg, flags);
+}
+
+// 尽可能多地发送发送队列中的数据，全部发送完返回1，需要等待返回0，出错返回-1
+static int flush_send_queue(connection *con){
+    send_chunk *c;
+    ssize_t nbytes;
+
+    while (con->chunk_pos < con->nchunks) {
+        c = &con->chunks[con->chunk_pos];
+
+        // 由内核直接把文件内容拷贝到socket，不经过用户态缓存
+        if (c->type == SEND_CHUNK_FILE)
+            nbytes = sendfile(con->sockfd, c->fd, &c->off, c->left);
+        else
+            nbytes = send_mem_chunks(con);
+
+        if (nbytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        // 文件在发送过程中被截断
+        if (nbytes == 0)
+            return -1;
+
+        metrics_sent(nbytes);
+        con->bytes_sent += nbytes;
+
+        if (c->type == SEND_CHUNK_FILE) {
+            // sendfile()已经更新了文件偏移
+            c->left -= nbytes;
+            if (c->left == 0) {
+                release_chunk(c);
+                con->chunk_pos++;
+            }
+        } else {
+            advance_chunks(con, nbytes);
+        }
+    }
+
+    send_queue_done(con);
+
+    return 1;
+}
+
+// 连接当前所处阶段的超时名称
+static const char* timeout_phase(connection *con){
+    if (con->state == CON_STATE_WRITE)
+        return "send";
+    if (con->request_start)
+        return "header";
+    return con->requests == 0 ? "first byte" : "idle";
+}
+
+time_t connection_deadline(server *serv, connection *con) {
+    config *conf = serv->conf;
+
+    if (con->state == CON_STATE_WRITE)
+        return conf->send_timeout > 0 ? con->send_since + conf->send_timeout : 0;
+
+    //请求已经开始，期限从第一个字节算起，之后陆续发来的数据不会延长期限
+    if (con->request_start)
+        return conf->header_timeout > 0 ? con->request_start + conf->header_timeout : 0;
+
+    if (con->requests == 0)
+        return conf->first_byte_timeout > 0 ? con->idle_since + conf->first_byte_timeout : 0;
+
+    return conf->keepalive_timeout > 0 ? con->idle_since + conf->keepalive_timeout : 0;
+}
+
+int connection_timed_out(server *serv, connection *con, time_t now) {
+    time_t deadline = connection_deadline(serv, con);
+    unsigned long long sent;
+
+    if (deadline == 0 || now < deadline)
+        return 0;
+
+    //发送中的连接在这个周期内有进展且平均速率足够时开始下一个周期
+    if (con->state == CON_STATE_WRITE) {
+        sent = con->bytes_sent - con->send_mark;
+        if (sent > 0 && sent >= (unsigned long long) serv->conf->send_min_rate * (now - con->send_since)) {
+            con->send_since = now;
+            con->send_mark = con->bytes_sent;
+            return 0;
+        }
+    }
+
+    log_info(serv, "socket %d %s timeout", con->sockfd, timeout_phase(con));
+    return 1;
+}
+
+// 等待socket可读或可写，最多等到deadline，deadline为0时一直等待
+static int wait_socket(connection *con, short events, time_t deadline){
+    struct pollfd pfd;
+    struct timeval now;
+    long ms = -1;
+
+    pfd.fd = con->sockfd;
+    pfd.events = events;
+
+    if (deadline) {
+        gettimeofday(&now, NULL);
+        ms = (deadline - now.tv_sec) * 1000 - now.tv_usec / 1000;
+        if (ms < 0)
+            ms = 0;
+    }
+
+    if (poll(&pfd, 1, ms) == -1 && errno != EINTR)
+        return -1;
+    return 0;
+}
+
+// 到达截止时间时检查是否超时
+static int check_deadline(server *serv, connection *con, time_t deadline){
+    time_t now = time(NULL);
+
+    return deadline && now >= deadline && connection_timed_out(serv, con, now);
+}
+
+// 在截止时间之前接收数据，超时返回-1并设置errno为ETIMEDOUT
+static ssize_t recv_before_deadline(server *serv, connection *con, char *buf, size_t len){
+    ssize_t nbytes;
+    time_t deadline;
+
+    while (1) {
+        nbytes = recv(con->sockfd, buf, len, 0);
+        if (nbytes >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return nbytes;
+
+        deadline = connection_deadline(serv, con);
+        if (wait_socket(con, POLLIN, deadline) == -1)
+            return -1;
+        if (check_deadline(serv, con, deadline)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+// 发送整个发送队列，发送太慢时与事件循环一样按最低发送速率关闭连接，全部发送完返回1
+static int flush_before_deadline(server *serv, connection *con){
+    time_t deadline;
     int ret;
+
+    con->state = CON_STATE_WRITE;
+    con->send_since = time(NULL);
+    con->send_mark = con->bytes_sent;
+
+    while ((ret = flush_send_queue(con)) == 0) {
+        deadline = connection_deadline(serv, con);
+        if (wait_socket(con, POLLOUT, deadline) == -1 || check_deadline(serv, con, deadline))
+            return -1;
+    }
+
+    con->state = CON_STATE_READ;
+    return ret;
+}
+
+int connection_handler(server *serv, connection *con) {
+    char buf[RECV_CHUNK];
+    int nbytes = 1;
+    int ret = 0;
     //socket id
     printf("socket: %d\n", con->sockfd);
+    metrics_connection(1);
 
-    //缓存接受字符
-    while ((nbytes = recv(con->sockfd, buf, sizeof(buf), 0)) > 0) {
-        string_append_len(con->recv_buf, buf, nbytes);
+    //用非阻塞socket和poll()等待，收发都不会越过连接的截止时间
+    fcntl(con->sockfd, F_SETFL, fcntl(con->sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    while (1) {
+        //缓存接受字符，上一批请求之后剩余的数据可能已经是完整的请求
+        if (http_request_complete(con) == 0) {
+            while ((nbytes = recv_before_deadline(serv, con, buf, sizeof(buf))) > 0) {
+                string_append_len(con->recv_buf, buf, nbytes);
+                mark_request_start(con);
+
+                if (http_request_complete(con) != 0)
+                    break;
+            }
+        }
 
-        if (http_request_complete(con) != 0)
+        if (nbytes <= 0) {
+            ret = -1;
+            //接收字节为0，说明套接字已关闭
+            if (nbytes == 0) {
+                printf("socket %d closed\n", con->sockfd);
+                log_info(serv, "socket %d closed", con->sockfd);
+
+            }
+            //等待请求超时，不完整的请求也不再响应
+            else if (errno == ETIMEDOUT) {
+                break;
+            }
+            //否则，错误
+            else {
+                perror("read");
+                log_error(serv, "read: %s", strerror(errno));
+            }
+
+            //没有收到新请求的任何数据时不需要响应
+            if (con->recv_buf->len == 0)
+                break;
+        }
+
+        //请求响应，接收队列中已经完整的流水线请求一起处理、一起发送
+        if (process_pipeline(serv, con) == 0)
+            process_request(serv, con);
+
+        if (flush_before_deadline(serv, con) != 1 || !con->keep_alive || nbytes <= 0)
             break;
     }
 
-    if (nbytes <= 0) {
-        ret = -1;
-        //接收字节为0，说明套接字已关闭
+    con->state = CON_STATE_CLOSE;
+    metrics_connection(0);
+
+    return ret;
+}
+
+// 处理接收队列中所有完整的请求，有响应需要发送时进入写状态，closed表示对端已关闭连接
+static void process_received(server *serv, connection *con, int closed){
+    if (process_pipeline(serv, con) > 0) {
+        con->state = CON_STATE_WRITE;
+        con->send_since = time(NULL);
+        con->send_mark = con->bytes_sent;
+        //对端关闭连接，已经收到的完整请求仍然需要响应
+        if (closed)
+            con->keep_alive = 0;
+    } else if (closed) {
+        con->state = CON_STATE_CLOSE;
+    }
+}
+
+// 读入socket中的可读数据直到EAGAIN或接收队列达到RECV_BUDGET，再处理其中所有完整的请求
+static void handle_readable(server *serv, connection *con){
+    char buf[RECV_CHUNK];
+    ssize_t nbytes;
+    int closed = 0;
+
+    while (con->recv_buf->len < RECV_BUDGET) {
+        nbytes = recv(con->sockfd, buf, sizeof(buf), 0);
+
+        if (nbytes > 0) {
+            string_append_len(con->recv_buf, buf, nbytes);
+            continue;
+        }
+
+        //对端关闭连接，已经收到的完整请求仍然需要响应
         if (nbytes == 0) {
-            printf("socket %d closed\n", con->sockfd);
             log_info(serv, "socket %d closed", con->sockfd);
-        
-        } 
-        //否则，错误
-        else if (nbytes < 0) {
-            perror("read");
+            closed = 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
             log_error(serv, "read: %s", strerror(errno));
+            con->state = CON_STATE_CLOSE;
+            return;
         }
-    } else {
-        ret = 0;
+
+        break;
     }
 
-    //请求响应
-    http_request_parse(serv, con); 
-    http_response_send(serv, con);
-    log_request(serv, con);
+    mark_request_start(con);
+    process_received(serv, con, closed);
+}
 
-    return ret;
-}
\ No newline at end of file
+connection_state connection_received(server *serv, connection *con, const char *data, size_t len, int closed) {
+    if (len > 0) {
+        string_append_len(con->recv_buf, data, len);
+        mark_request_start(con);
+    }
+
+    // 正在发送上一批响应时只追加数据，发送完毕后由connection_sent()继续处理
+    if (con->state == CON_STATE_READ)
+        process_received(serv, con, closed);
+
+    return con->state;
+}
+
+connection_state connection_sent(server *serv, connection *con, int closed) {
+    //持久连接继续处理接收队列中已有的请求
+    con->state = con->keep_alive ? CON_STATE_READ : CON_STATE_CLOSE;
+
+    if (con->state == CON_STATE_READ)
+        process_received(serv, con, closed);
+
+    return con->state;
+}
+
+connection_state connection_resume(server *serv, connection *con) {
+    while (con->state != CON_STATE_CLOSE) {
+        if (con->state == CON_STATE_READ) {
+            handle_readable(serv, con);
+            //没有读满时数据已读完，等待下一次可读事件；读满时已有的请求一定进入了写状态
+            if (con->state == CON_STATE_READ)
+                break;
+        }
+
+        if (con->state == CON_STATE_WRITE) {
+            switch (flush_send_queue(con)) {
+                case 0:
+                    //发送缓冲区已满，等待下一次可写事件
+                    return con->state;
+                case 1:
+                    //持久连接继续处理下一批请求
+                    con->state = con->keep_alive ? CON_STATE_READ : CON_STATE_CLOSE;
+                    break;
+                case -1:
+                    log_error(serv, "send: %s", strerror(errno));
+                    con->state = CON_STATE_CLOSE;
+                    break;
+            }
+        }
+    }
+
+    return con->state;
+}
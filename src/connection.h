@@ -1,15 +1,50 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <sys/uio.h>
+
 #include "server.h"
 
-// 接受客户端连接
-connection* connection_accept(server *serv);
+// 用已经接受的socket创建连接结构
+connection* connection_new(int sockfd, const struct sockaddr_in *addr);
+
+// 接受客户端连接，flags传递给accept4()，例如SOCK_NONBLOCK。准入控制拒绝的连接直接关闭，继续接受下一个，
+// 连续拒绝过多时返回NULL，监听socket上可能还有等待的连接
+connection* connection_accept(server *serv, int flags);
 
 // 关闭连接
 void connection_close(connection *con);
 
-// 处理客户端连接
+// 在一个进程中从头到尾处理一个客户端连接，收发按连接的截止时间等待
 int connection_handler(server *serv, connection *con);
 
-#endif
\ No newline at end of file
+// 非阻塞模式下收到就绪事件后继续处理连接，返回处理后的连接状态
+connection_state connection_resume(server *serv, connection *con);
+
+// 连接当前阶段的截止时间：等待第一个字节、收完请求头部、持久连接空闲，或发送中的下一个检查时间。0表示没有期限
+time_t connection_deadline(server *serv, connection *con);
+
+// 到达截止时间时检查连接是否超时，超时返回1并记录日志。发送中的连接在这个周期内有进展
+// 且不低于最低发送速率时开始下一个检查周期并返回0
+int connection_timed_out(server *serv, connection *con, time_t now);
+
+// 以下函数供基于完成通知的I/O后端使用，由后端自己收发数据
+
+// 收到对端的len字节数据，closed为1表示对端已关闭连接。读状态下处理接收队列中所有完整的请求，
+// 正在发送时只追加数据。返回处理后的连接状态
+connection_state connection_received(server *serv, connection *con, const char *data, size_t len, int closed);
+
+// 发送队列已经全部发送，持久连接继续处理接收队列中已有的请求，返回处理后的连接状态
+connection_state connection_sent(server *serv, connection *con, int closed);
+
+// 发送队列的当前数据块，队列为空时返回NULL
+send_chunk* connection_send_chunk(connection *con);
+
+// 把从当前位置开始的连续内存数据块填入iov，最多max个，返回填入的个数；
+// 当前数据块是文件时返回0。more为1表示这些数据块之后还有数据
+int connection_send_iov(connection *con, struct iovec *iov, int max, int *more);
+
+// 已发送nbytes字节（文件数据块为已读出的字节数），推进发送队列，全部发送完返回1
+int connection_advance(connection *con, size_t nbytes);
+
+#endif
@@ -0,0 +1,177 @@
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "event.h"
+#include "connection.h"
+#include "watcher.h"
+#include "metrics.h"
+#include "admission.h"
+
+// 每次epoll_wait()最多返回的事件数
+#define MAX_EVENTS 256
+
+// 用于区分监听socket和inotify事件的标记，连接事件的data.ptr指向连接结构
+static char listener_tag;
+static char watcher_tag;
+
+// 将文件描述符设置为非阻塞
+static void set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 事件循环的状态
+typedef struct {
+    server *serv;
+    int epfd;
+    watcher *w;
+    // 所有连接的超时定时器
+    timer_wheel timers;
+    int nconns;
+    // 本轮事件处理的时间
+    time_t now;
+} event_ctx;
+
+// 按连接当前的阶段重新设置超时定时器
+static void update_timer(event_ctx *ctx, connection *con){
+    time_t deadline = connection_deadline(ctx->serv, con);
+
+    if (deadline)
+        timer_set(&ctx->timers, &con->timer, deadline);
+    else
+        timer_cancel(&con->timer);
+}
+
+// 关闭连接时文件描述符会自动从epoll中移除
+static void close_connection(event_ctx *ctx, connection *con){
+    timer_cancel(&con->timer);
+    ctx->nconns--;
+    metrics_connection(0);
+    connection_close(con);
+}
+
+// 定时器到期，超时的连接直接关闭，发送速率足够的连接进入下一个检查周期
+static void expire_connection(timer_node *t, void *arg){
+    event_ctx *ctx = arg;
+    connection *con = timer_entry(t, connection, timer);
+
+    if (connection_timed_out(ctx->serv, con, ctx->now))
+        close_connection(ctx, con);
+    else
+        update_timer(ctx, con);
+}
+
+// 接受监听socket上所有等待的连接并注册到epoll
+static void accept_all(event_ctx *ctx){
+    struct epoll_event ev;
+    connection *con;
+
+    while ((con = connection_accept(ctx->serv, SOCK_NONBLOCK)) != NULL) {
+        // 读写事件一次注册，边缘触发下由连接状态决定下一步动作
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = con;
+
+        if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, con->sockfd, &ev) == -1) {
+            log_error(ctx->serv, "epoll_ctl: %s", strerror(errno));
+            connection_close(con);
+            continue;
+        }
+
+        ctx->nconns++;
+        metrics_connection(1);
+        update_timer(ctx, con);
+    }
+}
+
+void event_loop(server *serv) {
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    event_ctx ctx;
+    connection *con;
+    int n;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.serv = serv;
+    timer_wheel_init(&ctx.timers, time(NULL));
+    ctx.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx.epfd == -1) {
+        perror("epoll_create1");
+        log_error(serv, "epoll_create1: %s", strerror(errno));
+        exit(1);
+    }
+
+    // 监听socket使用水平触发，过载时每轮只拒绝有限的连接，剩下的下一轮继续处理
+    set_nonblocking(serv->sockfd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listener_tag;
+
+    if (epoll_ctl(ctx.epfd, EPOLL_CTL_ADD, serv->sockfd, &ev) == -1) {
+        perror("epoll_ctl");
+        log_error(serv, "epoll_ctl: %s", strerror(errno));
+        exit(1);
+    }
+
+    // 缓存属于当前事件循环，监视器也由它创建并在同一线程中处理
+    if ((ctx.w = watcher_init(serv)) != NULL) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &watcher_tag;
+
+        if (epoll_ctl(ctx.epfd, EPOLL_CTL_ADD, watcher_fd(ctx.w), &ev) == -1) {
+            log_error(serv, "epoll_ctl: %s", strerror(errno));
+            exit(1);
+        }
+    }
+
+    while (1) {
+        // 有连接时每秒醒来一次推进时间轮
+        n = epoll_wait(ctx.epfd, events, MAX_EVENTS, ctx.nconns ? 1000 : -1);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error(serv, "epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        ctx.now = time(NULL);
+        admission_batch_begin();
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listener_tag) {
+                accept_all(&ctx);
+                continue;
+            }
+
+            if (events[i].data.ptr == &watcher_tag) {
+                watcher_process(ctx.w);
+                continue;
+            }
+
+            con = events[i].data.ptr;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(&ctx, con);
+                continue;
+            }
+
+            if (connection_resume(serv, con) == CON_STATE_CLOSE)
+                close_connection(&ctx, con);
+            else
+                update_timer(&ctx, con);
+        }
+
+        // 处理截止时间已到的连接，一个连接的代价与等待中的连接总数无关
+        timer_wheel_advance(&ctx.timers, ctx.now, expire_connection, &ctx);
+
+        admission_batch_end(serv);
+    }
+
+    watcher_free(ctx.w);
+    close(ctx.epfd);
+}
@@ -0,0 +1,9 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "server.h"
+
+// 运行边缘触发的epoll事件循环，在一个进程中处理所有非阻塞连接
+void event_loop(server *serv);
+
+#endif
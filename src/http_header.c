@@ -1,27 +1,35 @@
 #include <assert.h>
 #include <string.h>
+#include <strings.h>
 
 #include "http_header.h"
 
 #define HEADER_SIZE_INC 20
 
-http_headers* http_headers_init() {
+http_headers* http_headers_init(arena *a) {
     http_headers *h;
     h = malloc(sizeof(*h));
     memset(h, 0, sizeof(*h));
+    h->arena = a;
     return h;
 }
 
 void http_headers_free(http_headers *h) {
     if (!h) return;
-    //逐个释放
+    http_headers_reset(h);
+
+    free(h->ptr);
+    free(h);
+}
+
+void http_headers_reset(http_headers *h) {
+    //逐个释放，从内存区分配的字符串不需要释放
     for (size_t i = 0; i < h->len; i++) {
         string_free(h->ptr[i].key);
         string_free(h->ptr[i].value);
     }
 
-    free(h->ptr);
-    free(h);
+    h->len = 0;
 }
 
 static void extend(http_headers *h){
@@ -32,29 +40,33 @@ static void extend(http_headers *h){
     }
 }
 
+static string* new_string(http_headers *h, const char *str){
+    return h->arena ? string_init_str_arena(h->arena, str) : string_init_str(str);
+}
+
 void http_headers_add(http_headers *h, const char *key, const char *value) {
     //确定头部不为空
     assert(h != NULL);
     //扩展头部
     extend(h);
     //添加
-    h->ptr[h->len].key = string_init_str(key); 
+    h->ptr[h->len].key = new_string(h, key); 
     //值是一个字符串
-    h->ptr[h->len].value = string_init_str(value);
+    h->ptr[h->len].value = new_string(h, value);
     h->len++;
 }
 
-void http_headers_add_int(http_headers *h, const char *key, int value) {
+void http_headers_add_int(http_headers *h, const char *key, long long value) {
     //确定头部不为空
     assert(h != NULL);
      //扩展头部
     extend(h);
 
     //将整型value转换为字符型
-    string *value_str = string_init();
-    string_append_int(value_str, value);
+    string *value_str = h->arena ? string_init_arena(h->arena) : string_init();
+    string_append_long(value_str, value);
 
-    h->ptr[h->len].key = string_init_str(key); 
+    h->ptr[h->len].key = new_string(h, key); 
     h->ptr[h->len].value = value_str;
     h->len++;
 }
@@ -3,14 +3,17 @@
 
 #include "server.h"
 
-// 初始化HTTP头部
-http_headers* http_headers_init();
+// 初始化HTTP头部，a不为NULL时键值字符串从内存区a分配
+http_headers* http_headers_init(arena *a);
 
 // 释放HTTP头部
 void http_headers_free(http_headers *h);
 
+// 清空HTTP头部，保留已分配的数组以便复用
+void http_headers_reset(http_headers *h);
+
 // 添加新的key-value对到HTTP头部
 void http_headers_add(http_headers *h, const char *key, const char *value);
-void http_headers_add_int(http_headers *h, const char *key, int value);
+void http_headers_add_int(http_headers *h, const char *key, long long value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "listener.h"
+
+// 设置一个可选的socket参数，失败时只记录日志，不影响启动
+static void set_option(server *serv, int level, int name, int value, const char *what){
+    if (setsockopt(serv->sockfd, level, name, &value, sizeof(value)) == -1)
+        log_error(serv, "setsockopt %s: %s", what, strerror(errno));
+}
+
+// 按配置调整监听socket。Linux上接受的连接会继承这些参数，不需要每次accept()后再设置；
+// TCP_DEFER_ACCEPT和TCP_FASTOPEN只作用于监听socket
+static void tune_listener(server *serv){
+    config *conf = serv->conf;
+
+    if (conf->tcp_nodelay)
+        set_option(serv, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+    // 接收缓冲区要在listen()之前设置，握手时才能协商合适的窗口缩放
+    if (conf->send_buffer > 0)
+        set_option(serv, SOL_SOCKET, SO_SNDBUF, conf->send_buffer, "SO_SNDBUF");
+    if (conf->recv_buffer > 0)
+        set_option(serv, SOL_SOCKET, SO_RCVBUF, conf->recv_buffer, "SO_RCVBUF");
+
+    // 超过net.core.busy_poll需要CAP_NET_ADMIN
+    if (conf->busy_poll > 0)
+        set_option(serv, SOL_SOCKET, SO_BUSY_POLL, conf->busy_poll, "SO_BUSY_POLL");
+
+    if (conf->tcp_keepalive_idle > 0) {
+        set_option(serv, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        set_option(serv, IPPROTO_TCP, TCP_KEEPIDLE, conf->tcp_keepalive_idle, "TCP_KEEPIDLE");
+        if (conf->tcp_keepalive_interval > 0)
+            set_option(serv, IPPROTO_TCP, TCP_KEEPINTVL, conf->tcp_keepalive_interval, "TCP_KEEPINTVL");
+        if (conf->tcp_keepalive_count > 0)
+            set_option(serv, IPPROTO_TCP, TCP_KEEPCNT, conf->tcp_keepalive_count, "TCP_KEEPCNT");
+    }
+
+    // 客户端发来请求数据后才完成accept()，只建立连接不发送数据的客户端不占用连接结构
+    if (conf->tcp_defer_accept > 0)
+        set_option(serv, IPPROTO_TCP, TCP_DEFER_ACCEPT, conf->tcp_defer_accept, "TCP_DEFER_ACCEPT");
+
+    // 允许客户端在SYN中携带请求，节省一个往返
+    if (conf->tcp_fastopen > 0)
+        set_option(serv, IPPROTO_TCP, TCP_FASTOPEN, conf->tcp_fastopen, "TCP_FASTOPEN");
+}
+
+void listener_open(server *serv, int reuseport) {
+    struct sockaddr_in serv_addr;
+    // 创建socket，ipv4,tcp
+    serv->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    //创建失败，写入日志
+    if (serv->sockfd < 0) {
+        perror("socket");
+        log_error(serv, "socket: %s", strerror(errno));
+        exit(1);
+    }
+
+    int yes = 1;
+    //设置套接口SO_REUSEADDR许套接口和一个已在使用中的地址捆绑
+    if ((setsockopt(serv->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+        log_error(serv, "socket: %s", strerror(errno));
+        exit(1);
+    }
+
+    // SO_REUSEPORT允许多个进程或线程各自绑定同一端口，由内核分发连接
+    if (reuseport && setsockopt(serv->sockfd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(int)) == -1) {
+        perror("setsockopt");
+        log_error(serv, "SO_REUSEPORT: %s", strerror(errno));
+        exit(1);
+    }
+
+    tune_listener(serv);
+
+    //初始化服务器地址
+    memset(&serv_addr, 0, sizeof serv_addr);
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(serv->port);
+
+    // bind() 绑定
+    if (bind(serv->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        perror("bind");
+        log_error(serv, "bind: %s", strerror(errno));
+        exit(1);
+    }
+
+    // listen() 监听，等待客户端连接
+    if (listen(serv->sockfd, serv->conf->listen_backlog) < 0) {
+        perror("listen");
+        log_error(serv, "listen: %s", strerror(errno));
+        exit(1);
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include "server.h"
+
+// 创建监听socket并保存到serv->sockfd，reuseport非0时设置SO_REUSEPORT
+void listener_open(server *serv, int reuseport);
+
+#endif
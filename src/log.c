@@ -2,12 +2,17 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <stdarg.h>
 #include "stringutils.h"
 #include "log.h"
+#include "metrics.h"
 
 void log_open(server *serv, const char *logfile) {
     //判断服务器是否启动日志
@@ -27,29 +32,27 @@ void log_open(server *serv, const char *logfile) {
 }
 
 void log_close(server *serv) {
+    log_async_stop(serv);
+
     if (serv->logfp)
         fclose(serv->logfp);
     closelog();
 }
 
-static void date_str(string *s){
+static void format_date(time_t rawtime, char *buf, size_t size){
     //定义一个时间结构
-    struct tm *ti;
-    //标准计时点到当前秒数
-    time_t rawtime;
+    struct tm ti;
     char local_date[100];
     char zone_str[20];
     int zone;
     char zone_sign;
 
-    //返回当前时间
-    time(&rawtime);
-    //转化为本地时间
-    ti = localtime(&rawtime);
+    //转化为本地时间，多个线程可能同时记录日志
+    localtime_r(&rawtime, &ti);
     //将时间转换成真实世界使用的日期表示方法
-    zone = ti->tm_gmtoff / 60;
+    zone = ti.tm_gmtoff / 60;
 
-    if (ti->tm_zone < 0) {
+    if (zone < 0) {
         zone_sign = '-';
         zone = -zone;
     } else
@@ -58,11 +61,249 @@ static void date_str(string *s){
     zone = (zone / 60) * 100 + zone % 60;
     
     //格式化本地时间和日期
-    strftime(local_date, sizeof(local_date), "%d/%b/%Y:%X", ti);
+    strftime(local_date, sizeof(local_date), "%d/%b/%Y:%X", &ti);
     snprintf(zone_str, sizeof(zone_str), " %c%.4d", zone_sign, zone);
+    snprintf(buf, size, "%s%s", local_date, zone_str);
+}
+
+static void date_str(string *s){
+    char date[LOG_DATE_SIZE];
 
-    string_append(s, local_date);
-    string_append(s, zone_str);
+    format_date(time(NULL), date, sizeof(date));
+    string_append(s, date);
+}
+
+/*
+ * 异步访问日志：请求处理中只把记录的原始字段复制进有界的无锁环形缓冲区，
+ * 由后台线程格式化后批量写入。多个事件循环线程可以同时写入，每个槽位的序号
+ * 表示它当前可以被写入还是读出。缓冲区满时丢弃记录并计数，由后台线程报告
+ */
+typedef struct {
+    // 槽位序号，等于写入位置时可写，等于写入位置加1时可读
+    size_t seq;
+    time_t time;
+    struct in_addr addr;
+    int status_code;
+    long long content_length;
+    char method[LOG_METHOD_SIZE];
+    char version[LOG_VERSION_SIZE];
+    char uri[LOG_URI_SIZE];
+} log_record;
+
+typedef struct {
+    log_record *slots;
+    size_t mask;
+    // 下一个写入位置，由各个线程竞争
+    size_t head;
+    // 下一个读出位置，只由后台线程修改
+    size_t tail;
+    // 缓冲区满时丢弃的记录数，后台线程报告后清零
+    unsigned long dropped;
+    int stop;
+    pthread_t tid;
+    server *serv;
+} log_ring;
+
+// 每个进程一个，prefork模式下每个工作进程各自启动
+static log_ring *ring;
+
+// 复制以'\0'结尾的字段，超过长度时截断
+static void copy_field(char *dst, size_t size, const char *src){
+    size_t len;
+
+    if (!src)
+        src = "-";
+    len = strlen(src);
+    if (len >= size)
+        len = size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+// 请求处理中调用，不分配内存也不阻塞，缓冲区满时返回-1
+static int ring_push(log_ring *r, connection *con){
+    http_request *req = con->request;
+    http_response *resp = con->response;
+    size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    log_record *rec;
+    intptr_t diff;
+
+    for (;;) {
+        rec = &r->slots[pos & r->mask];
+        diff = (intptr_t) __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+
+        if (diff == 0) {
+            // 槽位可写，抢到写入位置后独占该槽位
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // 槽位中的记录还没有被后台线程取走
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->time = time(NULL);
+    rec->addr = con->addr.sin_addr;
+    rec->status_code = con->status_code;
+    rec->content_length = (resp->content_length > -1 && req->method != HTTP_METHOD_HEAD) ?
+                          (long long) resp->content_length : -1;
+    copy_field(rec->method, sizeof(rec->method), req->method_raw);
+    copy_field(rec->version, sizeof(rec->version), req->version_raw);
+    copy_field(rec->uri, sizeof(rec->uri), req->uri);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// 将整块数据写入日志文件，日志文件以追加方式打开，多个进程的写入不会互相覆盖
+static void write_all(int fd, const char *buf, size_t len){
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// 取出缓冲区中所有可读的记录，格式化后一次写入，返回取出的记录数
+static size_t ring_drain(log_ring *r, char *out, size_t size){
+    server *serv = r->serv;
+    char host_ip[INET_ADDRSTRLEN];
+    char content_len[24];
+    char date[LOG_DATE_SIZE];
+    time_t date_time = -1;
+    log_record *rec;
+    size_t count = 0;
+    size_t len = 0;
+    int n;
+
+    while (1) {
+        rec = &r->slots[r->tail & r->mask];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != r->tail + 1)
+            break;
+
+        // 同一秒内的记录只格式化一次日期
+        if (rec->time != date_time) {
+            date_time = rec->time;
+            format_date(date_time, date, sizeof(date));
+        }
+
+        if (rec->content_length > -1)
+            snprintf(content_len, sizeof(content_len), "%lld", rec->content_length);
+        else
+            strcpy(content_len, "-");
+
+        inet_ntop(AF_INET, &rec->addr, host_ip, INET_ADDRSTRLEN);
+
+        if (serv->use_logfile) {
+            n = snprintf(out + len, size - len, "%s - - [%s] \"%s %s %s\" %d %s\n",
+                         host_ip, date, rec->method, rec->uri,
+                         rec->version, rec->status_code, content_len);
+            // 输出缓冲区放不下这条记录时先写出已有内容
+            if ((size_t) n >= size - len) {
+                write_all(fileno(serv->logfp), out, len);
+                len = 0;
+                continue;
+            }
+            len += n;
+        } else {
+            syslog(LOG_ERR, "%s - - [%s] \"%s %s %s\" %d %s",
+                   host_ip, date, rec->method, rec->uri,
+                   rec->version, rec->status_code, content_len);
+        }
+
+        // 槽位交还给写入方，序号推进一圈
+        __atomic_store_n(&rec->seq, r->tail + r->mask + 1, __ATOMIC_RELEASE);
+        r->tail++;
+        count++;
+    }
+
+    if (len > 0)
+        write_all(fileno(serv->logfp), out, len);
+
+    return count;
+}
+
+// 后台写日志线程，缓冲区为空时每隔LOG_FLUSH_MS毫秒检查一次
+static void* ring_writer(void *arg){
+    log_ring *r = arg;
+    struct timespec idle = {0, LOG_FLUSH_MS * 1000000L};
+    char *out = malloc(LOG_WRITE_SIZE);
+    unsigned long dropped;
+    int stop;
+
+    while (1) {
+        stop = __atomic_load_n(&r->stop, __ATOMIC_ACQUIRE);
+
+        if (ring_drain(r, out, LOG_WRITE_SIZE) == 0) {
+            if ((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)) > 0) {
+                log_error(r->serv, "access log buffer full, %lu records dropped", dropped);
+                metrics_log_dropped(dropped);
+            }
+            // 停止前已经取完全部记录
+            if (stop)
+                break;
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    free(out);
+    return NULL;
+}
+
+void log_async_start(server *serv) {
+    size_t n = 1;
+    sigset_t all, old;
+    int err;
+
+    if (serv->conf->log_buffer <= 0 || ring)
+        return;
+
+    // 槽位数取不小于配置的2的幂，用掩码计算下标
+    while (n < (size_t) serv->conf->log_buffer)
+        n <<= 1;
+
+    ring = calloc(1, sizeof(*ring));
+    ring->slots = calloc(n, sizeof(log_record));
+    if (!ring->slots) {
+        perror("calloc");
+        exit(1);
+    }
+    ring->mask = n - 1;
+    ring->serv = serv;
+    for (size_t i = 0; i < n; i++)
+        ring->slots[i].seq = i;
+
+    // 后台线程不处理信号，SIGTERM等仍由事件循环所在的线程接收
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&ring->tid, NULL, ring_writer, ring);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        log_error(serv, "pthread_create: %s", strerror(err));
+        exit(1);
+    }
+}
+
+void log_async_stop(server *serv) {
+    if (!ring)
+        return;
+
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(ring->tid, NULL);
+
+    free(ring->slots);
+    free(ring);
+    ring = NULL;
 }
 
 void log_request(server *serv, connection *con) {
@@ -71,20 +312,28 @@ void log_request(server *serv, connection *con) {
     http_response *resp = con->response;
     char host_ip[INET_ADDRSTRLEN];
     char content_len[20];
-    string *date = string_init();
+    string *date;
 
     //判断服务器或客户端是否启动
     if (!serv || !con)
         return;
 
+    // 异步模式下只复制记录，缓冲区满时丢弃并计数
+    if (ring) {
+        if (ring_push(ring, con) == -1)
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
     if (resp->content_length > -1 && req->method != HTTP_METHOD_HEAD) {
-        snprintf(content_len, sizeof(content_len), "%d", resp->content_length); 
+        snprintf(content_len, sizeof(content_len), "%lld", (long long) resp->content_length);
     } else {
         strcpy(content_len, "-");
     }
 
     //将二进制网络地址转换为ascall码
     inet_ntop(con->addr.sin_family, &con->addr.sin_addr, host_ip, INET_ADDRSTRLEN);
+    date = string_init_arena(con->arena);
     date_str(date);
 
     // 日志中需要记录的项目：IP，时间，访问方法，URI，版本，状态，内容长度
@@ -2,12 +2,30 @@
 #define LOG_H
 
 #include "server.h"
+
+// 日志中日期的最大长度
+#define LOG_DATE_SIZE 128
+// 异步日志记录中各字段的最大长度，超过时截断
+#define LOG_METHOD_SIZE 16
+#define LOG_VERSION_SIZE 16
+#define LOG_URI_SIZE 480
+// 后台线程每次批量写入的最大字节数
+#define LOG_WRITE_SIZE (64 * 1024)
+// 缓冲区为空时后台线程的检查间隔（毫秒）
+#define LOG_FLUSH_MS 10
+
 // 打开日志文件
 void log_open(server *serv, const char *logfile);
 
 // 关闭日志文件
 void log_close(server *serv);
 
+// 启动后台写日志线程，之后的访问日志先放入环形缓冲区，log-buffer为0时不启动
+void log_async_start(server *serv);
+
+// 写完缓冲区中剩余的记录后停止后台线程
+void log_async_stop(server *serv);
+
 // 记录HTTP请求
 void log_request(server *serv, connection *con);
 
@@ -0,0 +1,354 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "metrics.h"
+
+static const int status_codes[METRICS_STATUSES - 1] = {200, 206, 304, 400, 403, 404, 416, 431, 500, 501, 503};
+static const char *method_names[METRICS_METHODS] = {"GET", "HEAD", "other"};
+static const char *shed_reasons[METRICS_SHED_REASONS] = {"max_connections", "per_ip", "queue_delay"};
+
+// 延迟直方图各桶的上限（微秒）
+static const unsigned long latency_bounds[METRICS_LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+// 所有进程共享的槽位，fork()之前创建
+static metrics_slot *slots;
+static int nslots;
+// 当前线程使用的槽位
+static __thread metrics_slot *local;
+
+// fork模式下多个子进程共用一个槽位，计数器都用原子加法更新
+#define METRIC_ADD(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define METRIC_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static metrics_slot* my_slot(){
+    return local ? local : slots;
+}
+
+static long long now_us(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_attach(int index) {
+    if (slots)
+        local = &slots[index % nslots];
+}
+
+void metrics_connection(int opened) {
+    if (!slots)
+        return;
+
+    if (opened)
+        METRIC_ADD(my_slot()->connections_opened, 1);
+    else
+        METRIC_ADD(my_slot()->connections_closed, 1);
+}
+
+void metrics_request(connection *con) {
+    http_method method = con->request->method;
+    int m, s;
+
+    if (!slots)
+        return;
+
+    m = method == HTTP_METHOD_GET ? 0 : method == HTTP_METHOD_HEAD ? 1 : 2;
+    for (s = 0; s < METRICS_STATUSES - 1; s++) {
+        if (status_codes[s] == con->status_code)
+            break;
+    }
+    METRIC_ADD(my_slot()->requests[m][s], 1);
+
+    //发送队列中第一个响应的请求开始计时
+    if (con->pending == 0)
+        con->pending_since = now_us();
+    con->pending++;
+}
+
+void metrics_sent(size_t nbytes) {
+    if (slots)
+        METRIC_ADD(my_slot()->bytes_sent, nbytes);
+}
+
+void metrics_flushed(connection *con) {
+    metrics_slot *slot;
+    unsigned long us;
+    int b;
+
+    if (!slots || con->pending == 0)
+        return;
+
+    //流水线上一起处理的请求一起发送完，按同一个延迟记录
+    slot = my_slot();
+    us = now_us() - con->pending_since;
+    for (b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+        if (us <= latency_bounds[b])
+            break;
+    }
+
+    METRIC_ADD(slot->latency[b], con->pending);
+    METRIC_ADD(slot->latency_sum_us, us * con->pending);
+    METRIC_ADD(slot->latency_count, con->pending);
+    con->pending = 0;
+}
+
+void metrics_cache(int hit) {
+    if (!slots)
+        return;
+
+    if (hit)
+        METRIC_ADD(my_slot()->cache_hits, 1);
+    else
+        METRIC_ADD(my_slot()->cache_misses, 1);
+}
+
+void metrics_log_dropped(unsigned long n) {
+    if (slots)
+        METRIC_ADD(my_slot()->log_dropped, n);
+}
+
+void metrics_shed(int reason) {
+    if (slots)
+        METRIC_ADD(my_slot()->shed[reason], 1);
+}
+
+// 把所有槽位的计数器相加
+static void sum_slots(metrics_slot *total){
+    memset(total, 0, sizeof(*total));
+
+    for (int i = 0; i < nslots; i++) {
+        metrics_slot *s = &slots[i];
+
+        for (int m = 0; m < METRICS_METHODS; m++)
+            for (int c = 0; c < METRICS_STATUSES; c++)
+                total->requests[m][c] += METRIC_LOAD(s->requests[m][c]);
+        total->bytes_sent += METRIC_LOAD(s->bytes_sent);
+        total->connections_opened += METRIC_LOAD(s->connections_opened);
+        total->connections_closed += METRIC_LOAD(s->connections_closed);
+        total->cache_hits += METRIC_LOAD(s->cache_hits);
+        total->cache_misses += METRIC_LOAD(s->cache_misses);
+        total->log_dropped += METRIC_LOAD(s->log_dropped);
+        for (int r = 0; r < METRICS_SHED_REASONS; r++)
+            total->shed[r] += METRIC_LOAD(s->shed[r]);
+        for (int b = 0; b <= METRICS_LATENCY_BUCKETS; b++)
+            total->latency[b] += METRIC_LOAD(s->latency[b]);
+        total->latency_sum_us += METRIC_LOAD(s->latency_sum_us);
+        total->latency_count += METRIC_LOAD(s->latency_count);
+    }
+}
+
+static void append_metric(string *out, const char *name, const char *type, const char *help, unsigned long value){
+    char line[256];
+
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lu\n",
+             name, help, name, type, name, value);
+    string_append(out, line);
+}
+
+// 生成Prometheus文本格式的统计信息
+static void format_metrics(string *out){
+    metrics_slot t;
+    unsigned long cumulative = 0;
+    char line[256];
+
+    sum_slots(&t);
+
+    string_append(out, "# HELP cwebserver_requests_total HTTP requests by method and status code.\n"
+                       "# TYPE cwebserver_requests_total counter\n");
+    for (int m = 0; m < METRICS_METHODS; m++) {
+        for (int c = 0; c < METRICS_STATUSES; c++) {
+            if (t.requests[m][c] == 0)
+                continue;
+            if (c < METRICS_STATUSES - 1)
+                snprintf(line, sizeof(line), "cwebserver_requests_total{method=\"%s\",code=\"%d\"} %lu\n",
+                         method_names[m], status_codes[c], t.requests[m][c]);
+            else
+                snprintf(line, sizeof(line), "cwebserver_requests_total{method=\"%s\",code=\"other\"} %lu\n",
+                         method_names[m], t.requests[m][c]);
+            string_append(out, line);
+        }
+    }
+
+    append_metric(out, "cwebserver_sent_bytes_total", "counter", "Bytes written to client sockets.", t.bytes_sent);
+    append_metric(out, "cwebserver_connections_total", "counter", "Accepted connections.", t.connections_opened);
+    append_metric(out, "cwebserver_connections_active", "gauge", "Currently open connections.",
+                  t.connections_opened - t.connections_closed);
+    append_metric(out, "cwebserver_cache_hits_total", "counter", "File cache hits.", t.cache_hits);
+    append_metric(out, "cwebserver_cache_misses_total", "counter", "File cache misses.", t.cache_misses);
+    append_metric(out, "cwebserver_log_dropped_total", "counter", "Access log records dropped because the buffer was full.", t.log_dropped);
+
+    string_append(out, "# HELP cwebserver_shed_total Connections rejected with 503 by reason.\n"
+                       "# TYPE cwebserver_shed_total counter\n");
+    for (int r = 0; r < METRICS_SHED_REASONS; r++) {
+        snprintf(line, sizeof(line), "cwebserver_shed_total{reason=\"%s\"} %lu\n", shed_reasons[r], t.shed[r]);
+        string_append(out, line);
+    }
+
+    string_append(out, "# HELP cwebserver_request_duration_seconds Time from processing a request until its response is sent.\n"
+                       "# TYPE cwebserver_request_duration_seconds histogram\n");
+    for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++) {
+        cumulative += t.latency[b];
+        snprintf(line, sizeof(line), "cwebserver_request_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                 latency_bounds[b] / 1e6, cumulative);
+        string_append(out, line);
+    }
+    snprintf(line, sizeof(line), "cwebserver_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+                                 "cwebserver_request_duration_seconds_sum %.6f\n"
+                                 "cwebserver_request_duration_seconds_count %lu\n",
+             cumulative + t.latency[METRICS_LATENCY_BUCKETS], t.latency_sum_us / 1e6, t.latency_count);
+    string_append(out, line);
+}
+
+static void write_all(int fd, const char *buf, size_t len){
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// 处理一个统计接口的请求，只支持GET /metrics
+static void serve_client(int fd){
+    char req[1024];
+    ssize_t n;
+    size_t len = 0;
+    string *body;
+    char head[128];
+    int found;
+
+    // 读到请求头部结束为止，头部过长时只看请求行
+    while (len < sizeof(req) - 1 && (n = recv(fd, req + len, sizeof(req) - 1 - len, 0)) > 0) {
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    req[len] = '\0';
+
+    found = strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0;
+    body = string_init();
+    if (found)
+        format_metrics(body);
+    else
+        string_append(body, "not found\n");
+
+    snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             found ? "200 OK" : "404 Not Found",
+             found ? "text/plain; version=0.0.4" : "text/plain", body->len);
+    write_all(fd, head, strlen(head));
+    write_all(fd, body->ptr, body->len);
+
+    string_free(body);
+}
+
+// 统计接口线程，逐个处理连接。fork模式和prefork模式的主进程还会继续fork()，
+// 这里不使用stdio和日志，避免子进程继承被这个线程持有的锁
+static void* metrics_main(void *arg){
+    int lfd = *(int *) arg;
+    struct timeval tv = {1, 0};
+    int fd;
+
+    while (1) {
+        if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            // 文件描述符用完等持续的错误时稍等再重试，避免空转占满CPU
+            if (errno != EINTR && errno != ECONNABORTED)
+                poll(NULL, 0, 100);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        serve_client(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+void metrics_init(server *serv) {
+    config *conf = serv->conf;
+    static int lfd;
+    struct sockaddr_in addr;
+    sigset_t all, old;
+    pthread_t tid;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int yes = 1;
+    int err;
+
+    if (conf->metrics_port <= 0)
+        return;
+
+    if (conf->metrics_port > 65535) {
+        fprintf(stderr, "invalid metrics-port %d\n", conf->metrics_port);
+        exit(1);
+    }
+
+    // 每个prefork工作进程或事件循环线程一个槽位
+    nslots = conf->max_workers;
+    if (conf->threads > nslots)
+        nslots = conf->threads;
+    if (ncpu > nslots)
+        nslots = ncpu;
+
+    // 匿名共享内存，之后fork()的工作进程和子进程都更新同一份计数器
+    slots = mmap(NULL, nslots * sizeof(metrics_slot), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(slots, 0, nslots * sizeof(metrics_slot));
+
+    // 统计接口只监听本机地址
+    lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        perror("socket");
+        log_error(serv, "metrics socket: %s", strerror(errno));
+        exit(1);
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(conf->metrics_port);
+
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lfd, 16) < 0) {
+        perror("metrics bind");
+        log_error(serv, "metrics bind: %s", strerror(errno));
+        exit(1);
+    }
+
+    // 统计线程不处理信号
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&tid, NULL, metrics_main, &lfd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        log_error(serv, "pthread_create: %s", strerror(err));
+        exit(1);
+    }
+    pthread_detach(tid);
+
+    log_info(serv, "metrics on 127.0.0.1:%d/metrics", conf->metrics_port);
+}
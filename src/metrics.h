@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "server.h"
+
+// 统计的请求方法：GET、HEAD和其他
+#define METRICS_METHODS 3
+// 统计的状态码，最后一项为其他状态码
+#define METRICS_STATUSES 12
+// 延迟直方图的桶数，不含+Inf
+#define METRICS_LATENCY_BUCKETS 16
+
+// 拒绝连接的原因：连接总数达到上限、同一IP的连接数达到上限、排队延迟过高
+enum {
+    METRICS_SHED_MAX_CONNECTIONS,
+    METRICS_SHED_PER_IP,
+    METRICS_SHED_QUEUE_DELAY,
+    METRICS_SHED_REASONS
+};
+
+// 一个工作进程或线程的计数器，放在共享内存中，各自只更新自己的槽位
+typedef struct {
+    unsigned long requests[METRICS_METHODS][METRICS_STATUSES];
+    unsigned long bytes_sent;
+    unsigned long connections_opened;
+    unsigned long connections_closed;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+    unsigned long log_dropped;
+    unsigned long shed[METRICS_SHED_REASONS];
+    // 每个桶只记录落在该区间的请求数，输出时再累加
+    unsigned long latency[METRICS_LATENCY_BUCKETS + 1];
+    unsigned long latency_sum_us;
+    unsigned long latency_count;
+} __attribute__((aligned(64))) metrics_slot;
+
+// 创建共享内存中的计数器并在metrics-port上启动统计接口，metrics-port为0时不统计
+void metrics_init(server *serv);
+
+// 当前线程使用第index个槽位，没有调用时使用第0个
+void metrics_attach(int index);
+
+// 连接建立和关闭
+void metrics_connection(int opened);
+
+// 请求处理完毕，响应已加入发送队列
+void metrics_request(connection *con);
+
+// 向连接发送了nbytes字节
+void metrics_sent(size_t nbytes);
+
+// 发送队列中的响应全部发送完，记录其中各请求的延迟
+void metrics_flushed(connection *con);
+
+// 缓存命中或未命中
+void metrics_cache(int hit);
+
+// 访问日志缓冲区满时丢弃的记录数
+void metrics_log_dropped(unsigned long n);
+
+// 因为reason拒绝了一个连接
+void metrics_shed(int reason);
+
+#endif
@@ -0,0 +1,235 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "request.h"
+#include "response.h"
+#include "http_header.h"
+#include "stringutils.h"
+#include "arena.h"
+#include "log.h"
+
+// 热路径函数的微基准：在进程内用伪造的接收缓冲区直接调用各函数，不经过网络，
+// 报告每次操作的耗时和malloc()次数
+// 用法：./micro_bench [迭代次数]
+
+// 替换malloc()系列函数以统计分配次数，libc内部的分配也会经过这里
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocs;
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+static const char request_data[] =
+    "GET /static/css/../js/app.min.js?v=3 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"11e035-106-6ad422e3\"\r\n"
+    "\r\n";
+
+// 各用例共用的假连接和服务器
+static server serv;
+static config conf;
+static connection con;
+static http_headers *headers;
+static http_headers *arena_headers;
+static string *str;
+
+static double now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// 解析会在缓冲区中写入'\0'，每次迭代前恢复请求内容
+static void reset_request(void){
+    memcpy(con.recv_buf->ptr, request_data, sizeof(request_data) - 1);
+    con.recv_buf->len = sizeof(request_data) - 1;
+    con.request_len = 0;
+    con.status_code = 0;
+    con.recv_state = HTTP_RECV_STATE_WORD1;
+    http_request_reset(con.request);
+    arena_reset(con.arena);
+}
+
+static void bench_reset(void){
+    reset_request();
+}
+
+static void bench_complete(void){
+    reset_request();
+    http_request_complete(&con);
+}
+
+static void bench_parse(void){
+    reset_request();
+    http_request_complete(&con);
+    http_request_parse(&serv, &con);
+}
+
+static void bench_resolve_uri(void){
+    http_request_resolve_uri(&con, conf.doc_root, "/static/css/../js/%61pp.min.js?v=3");
+}
+
+static void bench_headers_malloc(void){
+    http_headers_reset(headers);
+    http_headers_add(headers, "Server", "cserver");
+    http_headers_add(headers, "Connection", "keep-alive");
+    http_headers_add(headers, "ETag", "\"11e035-106-6ad422e3\"");
+    http_headers_add(headers, "Content-Type", "text/html");
+    http_headers_add_int(headers, "Content-Length", 262);
+}
+
+static void bench_headers_arena(void){
+    arena_reset(con.arena);
+    http_headers_reset(arena_headers);
+    http_headers_add(arena_headers, "Server", "cserver");
+    http_headers_add(arena_headers, "Connection", "keep-alive");
+    http_headers_add(arena_headers, "ETag", "\"11e035-106-6ad422e3\"");
+    http_headers_add(arena_headers, "Content-Type", "text/html");
+    http_headers_add_int(arena_headers, "Content-Length", 262);
+}
+
+static void bench_string_append(void){
+    string_reset(str);
+    string_append(str, "HTTP/1.1 ");
+    string_append_int(str, 200);
+    string_append_ch(str, ' ');
+    string_append(str, "OK\r\n");
+    string_append_len(str, "Server: cserver\r\n", 17);
+    string_append(str, "Content-Length: ");
+    string_append_long(str, 1234567);
+    string_append(str, "\r\n\r\n");
+}
+
+static void bench_mime_hit(void){
+    http_response_mime_type("/var/www/static/js/app.min.js", "text/plain");
+}
+
+static void bench_mime_miss(void){
+    http_response_mime_type("/var/www/download/archive.tar.zst", "text/plain");
+}
+
+static void bench_log_request(void){
+    log_request(&serv, &con);
+    arena_reset(con.arena);
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} bench_case;
+
+// 除baseline外各用例的耗时都包含恢复请求内容的开销，parse包含complete
+static const bench_case cases[] = {
+    {"reset (baseline)", bench_reset},
+    {"http_request_complete", bench_complete},
+    {"http_request_parse", bench_parse},
+    {"http_request_resolve_uri", bench_resolve_uri},
+    {"http_headers_add (malloc)", bench_headers_malloc},
+    {"http_headers_add (arena)", bench_headers_arena},
+    {"string_append*", bench_string_append},
+    {"mime_type (hit)", bench_mime_hit},
+    {"mime_type (miss)", bench_mime_miss},
+};
+
+static void run(const char *name, void (*fn)(void), long iters){
+    unsigned long a;
+    double start, ns;
+
+    // 预热，使缓冲区和数组扩容到稳定大小
+    for (long i = 0; i < iters / 100 + 1; i++)
+        fn();
+
+    a = allocs;
+    start = now_ns();
+    for (long i = 0; i < iters; i++)
+        fn();
+    ns = (now_ns() - start) / iters;
+    a = allocs - a;
+
+    printf("%-28s %10.1f %12.2f\n", name, ns, (double) a / iters);
+}
+
+int main(int argc, char **argv) {
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+
+    if (iters <= 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    // 解析只访问配置中的Web文件目录，不打开文件
+    strcpy(conf.doc_root, "/var/www");
+    serv.conf = &conf;
+    serv.root_fd = -1;
+    serv.use_logfile = 1;
+    serv.logfp = fopen("/dev/null", "w");
+    if (!serv.logfp) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    con.sockfd = -1;
+    con.arena = arena_init(4096);
+    con.recv_buf = string_init();
+    con.send_buf = string_init();
+    con.request = http_request_init();
+    con.response = http_response_init(con.arena);
+    con.rel_path = con.real_path;
+    string_extend(con.recv_buf, 4096);
+
+    headers = http_headers_init(NULL);
+    arena_headers = http_headers_init(con.arena);
+    str = string_init();
+
+    printf("%-28s %10s %12s\n", "case", "ns/op", "allocs/op");
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        run(cases[i].name, cases[i].fn, iters);
+
+    // 日志记录已解析的请求，同步写入时每条都调用fflush()，只跑十分之一的次数
+    bench_parse();
+    run("log_request (sync)", bench_log_request, iters / 10);
+
+    // 异步日志只把记录复制进环形缓冲区
+    conf.log_buffer = 1 << 16;
+    log_async_start(&serv);
+    run("log_request (async)", bench_log_request, iters / 10);
+    log_async_stop(&serv);
+
+    http_headers_free(headers);
+    http_headers_free(arena_headers);
+    string_free(str);
+    http_request_free(con.request);
+    http_response_free(con.response);
+    string_free(con.recv_buf);
+    string_free(con.send_buf);
+    arena_free(con.arena);
+    fclose(serv.logfp);
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "prefork.h"
+#include "listener.h"
+#include "connection.h"
+#include "watcher.h"
+#include "metrics.h"
+
+// 工作进程槽位状态
+typedef enum {
+    WORKER_SLOT_EMPTY,
+    WORKER_SLOT_IDLE,
+    WORKER_SLOT_BUSY
+} worker_slot_state;
+
+// 记分板中的工作进程槽位，放在共享内存中由主进程读取
+typedef struct {
+    pid_t pid;
+    volatile sig_atomic_t state;
+} worker_slot;
+
+// 所有工作进程的记分板
+static worker_slot *scoreboard;
+static int scoreboard_len;
+
+// 工作进程收到SIGTERM后在处理完当前连接时退出
+static volatile sig_atomic_t worker_stop;
+// 主进程收到SIGTERM或SIGINT后结束所有工作进程
+static volatile sig_atomic_t master_stop;
+
+static void worker_stop_handler(int s) {
+    worker_stop = 1;
+}
+
+static void master_stop_handler(int s) {
+    master_stop = 1;
+}
+
+// SIGCHLD只用于打断主进程的sleep()
+static void master_chld_handler(int s) {
+}
+
+static void set_signal(int signo, void (*handler)(int)){
+    struct sigaction sa;
+
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    if (sigaction(signo, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+}
+
+// 工作进程主循环：在自己的监听socket上逐个接受并处理连接
+static void worker_main(server *serv, worker_slot *slot){
+    struct pollfd fds[2];
+    sigset_t term;
+    connection *con;
+    watcher *w;
+
+    set_signal(SIGCHLD, SIG_DFL);
+    set_signal(SIGINT, SIG_DFL);
+    set_signal(SIGPIPE, SIG_IGN);
+    set_signal(SIGTERM, worker_stop_handler);
+
+    // 处理连接期间屏蔽SIGTERM，避免打断正在进行的recv()/send()
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+
+    listener_open(serv, 1);
+    metrics_attach(slot - scoreboard);
+    // 线程不会被fork()复制，后台写日志线程在工作进程中启动
+    log_async_start(serv);
+
+    // 每个工作进程有自己的缓存，也需要自己的inotify实例
+    w = watcher_init(serv);
+    fds[0].fd = serv->sockfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = w ? watcher_fd(w) : -1;
+    fds[1].events = POLLIN;
+
+    while (!worker_stop) {
+        slot->state = WORKER_SLOT_IDLE;
+
+        // 等待连接的同时处理文件变化事件
+        if (w) {
+            if (poll(fds, 2, -1) <= 0)
+                continue;
+            if (fds[1].revents & POLLIN)
+                watcher_process(w);
+            if (!(fds[0].revents & POLLIN))
+                continue;
+        }
+
+        if ((con = connection_accept(serv, 0)) == NULL)
+            continue;
+
+        sigprocmask(SIG_BLOCK, &term, NULL);
+        slot->state = WORKER_SLOT_BUSY;
+
+        connection_handler(serv, con);
+        connection_close(con);
+
+        sigprocmask(SIG_UNBLOCK, &term, NULL);
+    }
+
+    watcher_free(w);
+    close(serv->sockfd);
+    log_async_stop(serv);
+    exit(0);
+}
+
+// 在空槽位中启动一个新的工作进程
+static int spawn_worker(server *serv){
+    worker_slot *slot = NULL;
+    pid_t pid;
+
+    for (int i = 0; i < scoreboard_len; i++) {
+        if (scoreboard[i].state == WORKER_SLOT_EMPTY) {
+            slot = &scoreboard[i];
+            break;
+        }
+    }
+
+    if (!slot)
+        return -1;
+
+    // 新进程在打开监听socket之前不计入空闲进程
+    slot->state = WORKER_SLOT_BUSY;
+
+    switch (pid = fork()) {
+        case 0:
+            worker_main(serv, slot);
+            break;
+        case -1:
+            slot->state = WORKER_SLOT_EMPTY;
+            log_error(serv, "fork: %s", strerror(errno));
+            return -1;
+    }
+
+    slot->pid = pid;
+    return 0;
+}
+
+// 回收退出的工作进程并释放其槽位
+static void reap_workers(server *serv){
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < scoreboard_len; i++) {
+            if (scoreboard[i].state != WORKER_SLOT_EMPTY && scoreboard[i].pid == pid) {
+                scoreboard[i].state = WORKER_SLOT_EMPTY;
+                break;
+            }
+        }
+
+        if (WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM)
+            log_error(serv, "worker %d killed by signal %d", pid, WTERMSIG(status));
+        else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            log_error(serv, "worker %d exited with status %d", pid, WEXITSTATUS(status));
+    }
+}
+
+// 根据空闲进程数扩大或缩小进程池，每轮最多增减一个空闲进程
+static void adjust_pool(server *serv){
+    config *conf = serv->conf;
+    int total = 0;
+    int idle = 0;
+    int victim = -1;
+
+    for (int i = 0; i < scoreboard_len; i++) {
+        if (scoreboard[i].state == WORKER_SLOT_EMPTY)
+            continue;
+        total++;
+        if (scoreboard[i].state == WORKER_SLOT_IDLE) {
+            idle++;
+            victim = i;
+        }
+    }
+
+    // 立即补足退出的工作进程
+    for (; total < conf->workers; total++)
+        spawn_worker(serv);
+
+    if (idle < conf->min_spare_workers && total < scoreboard_len) {
+        spawn_worker(serv);
+    } else if (idle > conf->max_spare_workers && total > conf->workers) {
+        kill(scoreboard[victim].pid, SIGTERM);
+    }
+}
+
+void prefork_run(server *serv) {
+    config *conf = serv->conf;
+
+    scoreboard_len = conf->max_workers;
+    if (conf->workers > scoreboard_len)
+        conf->workers = scoreboard_len;
+
+    // 匿名共享内存，fork()后主进程和所有工作进程都可见
+    scoreboard = mmap(NULL, scoreboard_len * sizeof(worker_slot), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    memset(scoreboard, 0, scoreboard_len * sizeof(worker_slot));
+
+    // 主进程只负责管理，不接受连接，否则内核会把连接分配给它的监听socket
+    close(serv->sockfd);
+    serv->sockfd = -1;
+
+    set_signal(SIGCHLD, master_chld_handler);
+    set_signal(SIGTERM, master_stop_handler);
+    set_signal(SIGINT, master_stop_handler);
+
+    for (int i = 0; i < conf->workers; i++)
+        spawn_worker(serv);
+
+    while (!master_stop) {
+        sleep(1);
+        reap_workers(serv);
+        if (!master_stop)
+            adjust_pool(serv);
+    }
+
+    // 通知所有工作进程退出并等待它们结束
+    for (int i = 0; i < scoreboard_len; i++) {
+        if (scoreboard[i].state != WORKER_SLOT_EMPTY)
+            kill(scoreboard[i].pid, SIGTERM);
+    }
+    while (wait(NULL) > 0);
+
+    munmap(scoreboard, scoreboard_len * sizeof(worker_slot));
+}
@@ -0,0 +1,9 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include "server.h"
+
+// 运行prefork模式：主进程管理常驻工作进程池，每个工作进程拥有自己的SO_REUSEPORT监听socket
+void prefork_run(server *serv);
+
+#endif
@@ -0,0 +1,118 @@
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "reactor.h"
+#include "listener.h"
+#include "event.h"
+#include "metrics.h"
+
+// 事件循环线程的参数
+typedef struct {
+    // 线程私有的服务器结构，监听socket各不相同，配置共享且只读
+    server serv;
+    // 线程编号，同时也是监听socket在SO_REUSEPORT组中的序号
+    int index;
+    // 绑定的CPU，-1表示不绑定
+    int cpu;
+    pthread_t tid;
+} reactor_thread;
+
+// 按当前CPU编号选择SO_REUSEPORT组中的socket，使连接留在接收它的CPU上
+static void attach_cpu_steering(server *serv, int nthreads){
+    struct sock_filter code[] = {
+        // A = 当前CPU编号
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        // A = A % nthreads
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, nthreads },
+        // 返回socket序号
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code
+    };
+
+    if (setsockopt(serv->sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        log_error(serv, "SO_ATTACH_REUSEPORT_CBPF: %s", strerror(errno));
+}
+
+static void* reactor_main(void *arg){
+    reactor_thread *t = arg;
+    cpu_set_t set;
+
+    if (t->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu, &set);
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            log_error(&t->serv, "thread %d: failed to pin to cpu %d", t->index, t->cpu);
+    }
+
+    metrics_attach(t->index);
+    event_loop(&t->serv);
+    return NULL;
+}
+
+void reactor_run(server *serv) {
+    config *conf = serv->conf;
+    reactor_thread *threads;
+    cpu_set_t allowed;
+    int nthreads = conf->threads;
+    int err;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        CPU_ZERO(&allowed);
+
+    // 主线程的监听socket必须先关闭，否则它会占用SO_REUSEPORT组中的一个序号
+    close(serv->sockfd);
+    serv->sockfd = -1;
+
+    threads = calloc(nthreads, sizeof(*threads));
+
+    // 按顺序创建监听socket，使第i个socket在组中的序号为i
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].serv = *serv;
+        threads[i].index = i;
+        threads[i].cpu = (conf->cpu_pinning && CPU_ISSET(i, &allowed)) ? i : -1;
+        listener_open(&threads[i].serv, 1);
+
+        // 每个线程使用自己的缓存，热路径上不共享数据，总大小仍为配置的大小
+        if (serv->cache) {
+            threads[i].serv.cache = cache_init(serv->cache->max_bytes / nthreads,
+                                               serv->cache->max_file_size,
+                                               serv->cache->revalidate);
+        }
+    }
+
+    // 线程数多于CPU数时按CPU分发会让多出的线程收不到连接，此时交给内核哈希分发
+    if (conf->cpu_pinning && nthreads > 1 && nthreads <= sysconf(_SC_NPROCESSORS_ONLN))
+        attach_cpu_steering(&threads[0].serv, nthreads);
+
+    log_info(serv, "starting %d event loop threads", nthreads);
+
+    for (int i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&threads[i].tid, NULL, reactor_main, &threads[i])) != 0) {
+            log_error(serv, "pthread_create: %s", strerror(err));
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        cache_free(threads[i].serv.cache);
+    }
+
+    free(threads);
+}
@@ -0,0 +1,9 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "server.h"
+
+// 运行threads模式：每个线程拥有自己的SO_REUSEPORT监听socket和epoll事件循环
+void reactor_run(server *serv);
+
+#endif
@@ -1,47 +1,92 @@
 #include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <assert.h>
 #include <stdio.h>
 
 #include "request.h"
-#include "http_header.h"
+#include "scan.h"
 
 http_request* http_request_init() {
     http_request *req;
     //分配内存
     req = malloc(sizeof(*req));
-    req->content_length = 0;
-    req->version = HTTP_VERSION_UNKNOWN;
-    req->content_length = -1;
+    http_request_reset(req);
 
-    req->headers = http_headers_init();
     return req; 
 }
 
-void http_request_free(http_request *req) {
-    if (!req) return;
+void http_request_reset(http_request *req) {
+    req->method = HTTP_METHOD_UNKNOWN;
+    req->version = HTTP_VERSION_UNKNOWN;
+    memset(&req->method_slice, 0, sizeof(req->method_slice));
+    memset(&req->uri_slice, 0, sizeof(req->uri_slice));
+    memset(&req->version_slice, 0, sizeof(req->version_slice));
+    req->nheaders = 0;
+    req->buf = NULL;
+    req->method_raw = NULL;
+    req->version_raw = NULL;
+    req->uri = NULL;
+    req->content_length = -1;
+}
 
-    http_headers_free(req->headers);
-    free(req);
+const char* http_request_header(http_request *req, const char *key) {
+    size_t key_len = strlen(key);
+    http_header_slice *h;
+
+    for (size_t i = 0; i < req->nheaders; i++) {
+        h = &req->headers[i];
+        if (h->key.len == key_len && strncasecmp(req->buf + h->key.off, key, key_len) == 0)
+            return req->buf + h->value.off;
+    }
+
+    return NULL;
 }
 
-static char* match_until(char **buf, const char *delims){
-    //初始化match
-    char *match = *buf;
-    //match添加buf中第一次出现delims之前的长度
-    char *end_match = match + strcspn(*buf, delims);
-    //end_match后添加end_match中delims出现次数
-    char *end_delims = end_match + strspn(end_match, delims);
+int http_request_has_token(http_request *req, const char *key, const char *token) {
+    const char *p = http_request_header(req, key);
+    size_t token_len = strlen(token);
+    size_t len;
 
-    for (char *p = end_match; p < end_delims; p++) {
-        *p = '\0';
+    if (!p)
+        return 0;
+
+    while (*p) {
+        //跳过分隔符和空白
+        p += strspn(p, ", \t");
+        len = strcspn(p, ", \t");
+
+        if (len == token_len && strncasecmp(p, token, len) == 0)
+            return 1;
+
+        p += len;
     }
 
-    *buf = end_delims;
+    return 0;
+}
+
+int http_request_keep_alive(http_request *req) {
+    // 带有请求体的请求无法跳过请求体，不能继续复用连接
+    if (http_request_header(req, "Content-Length") ||
+        http_request_header(req, "Transfer-Encoding"))
+        return 0;
+
+    // HTTP/1.1默认保持连接，HTTP/1.0需要显式要求
+    if (req->version == HTTP_VERSION_11)
+        return !http_request_has_token(req, "Connection", "close");
+    if (req->version == HTTP_VERSION_10)
+        return http_request_has_token(req, "Connection", "keep-alive");
 
-    return (end_match != end_delims) ? match : NULL;
+    return 0;
+}
+
+void http_request_free(http_request *req) {
+    if (!req) return;
+
+    free(req);
 }
 
 static http_method get_method(const char *method){
@@ -56,35 +101,94 @@ static http_method get_method(const char *method){
     return HTTP_METHOD_UNKNOWN;
 }
 
-static int resolve_uri(char *resolved_path, char *root, char *uri){
-    int ret = 0;
-    //初始化完整路径
-    string *path = string_init_str(root);
-    string_append(path, uri);
-
-    //绝对路径
-    char *res = realpath(path->ptr, resolved_path);
-    
-    if (!res) {
-        ret = -1;
-        goto cleanup;
-    }
+static int hex_value(int c){
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
 
-    size_t resolved_path_len = strlen(resolved_path);
+/*
+ * 不访问文件系统，按字面规范化URI中的路径，结果写入real_path：
+ * 去掉查询字符串，解码%XX，合并重复的'/'，处理'.'和'..'，以'/'结尾时加上index.html。
+ * real_path为Web文件目录加上规范化后的相对路径，rel_path指向其中的相对路径。
+ * 返回0成功，-1格式错误，-2越过了Web文件目录
+ */
+int http_request_resolve_uri(connection *con, const char *root, const char *uri) {
+    char *out = con->real_path;
+    char *end = con->real_path + sizeof(con->real_path);
     size_t root_len = strlen(root);
+    char *rel, *p;
+    int c, hi, lo;
+
+    // 只接受以'/'开头的路径
+    if (uri[0] != '/')
+        return -1;
+
+    if (root_len + 1 >= sizeof(con->real_path))
+        return -1;
+    memcpy(out, root, root_len);
+    p = out + root_len;
+    if (root_len == 0 || p[-1] != '/')
+        *p++ = '/';
+    rel = p;
+
+    // 每个路径段先解码写入p之后，再按内容决定保留还是回退
+    while (*uri && *uri != '?' && *uri != '#') {
+        char *seg = p;
+        int sep = 0;
+
+        while (*uri && *uri != '?' && *uri != '#') {
+            c = (unsigned char) *uri++;
+            if (c == '%') {
+                if ((hi = hex_value(uri[0])) < 0 || (lo = hex_value(uri[1])) < 0)
+                    return -1;
+                c = (hi << 4) | lo;
+                uri += 2;
+                // 不允许编码后的'\0'截断路径
+                if (c == '\0')
+                    return -1;
+            }
+            // 解码出的'/'同样作为分隔符
+            if (c == '/') {
+                sep = 1;
+                break;
+            }
+            if (p + 1 >= end)
+                return -1;
+            *p++ = c;
+        }
 
-    //比较路径
-    if (resolved_path_len < root_len) {
-        ret = -1;
-    } else if (strncmp(resolved_path, root, root_len) != 0) {
-        ret = -1;
-    } else if(uri[0] == '/' && uri[1] == '\0') {
-        strcat(resolved_path, "/index.html");
+        if (p == seg || (p - seg == 1 && seg[0] == '.')) {
+            // 空段和'.'不改变路径
+            p = seg;
+        } else if (p - seg == 2 && seg[0] == '.' && seg[1] == '.') {
+            // '..'回到上一段，不能越过Web文件目录
+            if (seg == rel)
+                return -2;
+            p = seg - 1;
+            while (p > rel && p[-1] != '/')
+                p--;
+        } else if (sep) {
+            if (p + 1 >= end)
+                return -1;
+            *p++ = '/';
+        }
     }
 
-cleanup:
-    string_free(path);
-    return ret;
+    // 以'/'、'.'或'..'结尾时指向目录，使用其中的index.html
+    if (p == rel || p[-1] == '/') {
+        if (end - p <= (ptrdiff_t) sizeof("index.html") - 1)
+            return -1;
+        memcpy(p, "index.html", sizeof("index.html"));
+    } else {
+        *p = '\0';
+    }
+
+    con->rel_path = rel;
+    return 0;
 }
 
 static void try_set_status(connection *con, int status_code){
@@ -93,17 +197,20 @@ static void try_set_status(connection *con, int status_code){
 }
 
 void http_request_parse(server *serv, connection *con) {
-    //初始化请求
+    //请求行和头部已经在接收时切分好，这里只需要解释各部分
     http_request *req = con->request;
     char *buf = con->recv_buf->ptr;
-    //解析HTTP方法
-    req->method_raw = match_until(&buf, " ");
-    //方法为空，错误
-    if (!req->method_raw) {
-        con->status_code = 400;
+
+    //请求格式错误或没有完整接收，头部过长时已经设置了431
+    if (con->recv_state != HTTP_RECV_STATE_DONE) {
+        try_set_status(con, 400);
         return;
     }
 
+    req->buf = buf;
+    req->method_raw = buf + req->method_slice.off;
+    req->uri = buf + req->uri_slice.off;
+
     // 获得HTTP方法
     req->method = get_method(req->method_raw);
 
@@ -115,21 +222,18 @@ void http_request_parse(server *serv, connection *con) {
         return;
     }
 
-    // 获得URI
-    req->uri = match_until(&buf, " \r\n");
-
-    if (!req->uri) {
-        con->status_code = 400;
-        return;
-    }
-
     /*
-     * 判断访问的资源是否在服务器上
+     * 规范化请求的路径，文件是否存在在打开时判断
      *
      */
-    if (resolve_uri(con->real_path, serv->conf->doc_root, req->uri) == -1) {
+    switch (http_request_resolve_uri(con, serv->conf->doc_root, req->uri)) {
+    case -1:
+        con->status_code = 400;
+        return;
+    case -2:
         try_set_status(con, 404);
-    } 
+        break;
+    }
     
     // 如果版本为HTTP_VERSION_09立刻退出
     if (req->version == HTTP_VERSION_09) {
@@ -139,12 +243,7 @@ void http_request_parse(server *serv, connection *con) {
     }
 
     // 获得HTTP版本
-    req->version_raw = match_until(&buf, "\r\n");
-
-    if (!req->version_raw) {
-        con->status_code = 400;
-        return;
-    }
+    req->version_raw = buf + req->version_slice.off;
 
     // 支持HTTP/1.0或HTTP/1.1
     if (strcasecmp(req->version_raw, "HTTP/1.0") == 0) {
@@ -158,87 +257,166 @@ void http_request_parse(server *serv, connection *con) {
     if (con->status_code > 0)
         return;
 
-    // 解析HTTP请求头部
-
-    char *p = buf;
-    char *endp = con->recv_buf->ptr + con->request_len;
-
-    while (p < endp) {
-        const char *key = match_until(&p, ": ");
-        const char *value = match_until(&p, "\r\n");
+    con->status_code = 200;
+}
 
-        if (!key || !value) {
-            con->status_code = 400;
-            return;
-        }
+//记录一段的结束位置end，去掉结尾的'\r'和空白后写入'\0'，之后可以直接作为字符串使用
+static void end_slice(connection *con, http_slice *s, size_t end){
+    char *buf = con->recv_buf->ptr;
 
-        http_headers_add(req->headers, key, value);
-    }
+    while (end > s->off && (buf[end - 1] == '\r' || buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+        end--;
 
-    con->status_code = 200;
+    s->len = end - s->off;
+    buf[end] = '\0';
 }
 
 int http_request_complete(connection *con) {
+    http_request *req = con->request;
+    //状态和位置放在局部变量中，返回前写回连接
+    char *buf = con->recv_buf->ptr;
+    //只检查请求行和头部长度上限以内的数据
+    size_t len = con->recv_buf->len < HTTP_REQUEST_SIZE_MAX ? con->recv_buf->len : HTTP_REQUEST_SIZE_MAX;
+    size_t i = con->request_len;
+    http_recv_state state = con->recv_state;
+    http_header_slice *h;
+    int ret = 0;
     char c;
-    for (; con->request_len < con->recv_buf->len; con->request_len++) {
-        c = con->recv_buf->ptr[con->request_len];
+    //已经判断过的请求，直接返回
+    if (state == HTTP_RECV_STATE_DONE)
+        return 1;
+    if (state == HTTP_RECV_STATE_ERROR)
+        return -1;
+
+    //从上次停下的位置继续，每个字节只检查一次，同时记录请求行和头部各部分的位置
+    for (; i < len; i++) {
+        //URI、头部名称和值中的普通字符不改变状态，用向量指令成块跳过
+        if (state == HTTP_RECV_STATE_WORD2)
+            i += scan->uri(buf + i, len - i);
+        else if (state == HTTP_RECV_STATE_KEY)
+            i += scan->token(buf + i, len - i);
+        else if (state == HTTP_RECV_STATE_VALUE)
+            i += scan->value(buf + i, len - i);
+
+        if (i == len)
+            break;
+
+        c = buf[i];
         //判断接收状态
-        switch (con->recv_state) {
+        switch (state) {
             case HTTP_RECV_STATE_WORD1:
-                if (c == ' ')
-                    con->recv_state = HTTP_RECV_STATE_SP1;
-                else if (!isalpha(c))
-                    return -1;
+                if (c == ' ') {
+                    end_slice(con, &req->method_slice, i);
+                    state = HTTP_RECV_STATE_SP1;
+                } else if (!isalpha(c))
+                    goto error;
             break;
 
             case HTTP_RECV_STATE_SP1:
                 if (c == ' ')
                     continue;
                 if (c == '\r' || c == '\n' || c == '\t')
-                    return -1;
-                con->recv_state = HTTP_RECV_STATE_WORD2;
+                    goto error;
+                req->uri_slice.off = i;
+                state = HTTP_RECV_STATE_WORD2;
             break;
 
             case HTTP_RECV_STATE_WORD2:
                 if (c == '\n') {
-                    con->request_len++;
-                    con->request->version = HTTP_VERSION_09;
-                    return 1;
-                } else if (c == ' ')
-                    con->recv_state = HTTP_RECV_STATE_SP2;
-                else if (c == '\t')
-                    return -1;
+                    end_slice(con, &req->uri_slice, i);
+                    req->version = HTTP_VERSION_09;
+                    goto done;
+                } else if (c == ' ') {
+                    end_slice(con, &req->uri_slice, i);
+                    state = HTTP_RECV_STATE_SP2;
+                } else if (c == '\t')
+                    goto error;
             break;
 
             case HTTP_RECV_STATE_SP2:
                 if (c == ' ')
                     continue;    
                 if (c == '\r' || c == '\n' || c == '\t')
-                    return -1;
-                con->recv_state = HTTP_RECV_STATE_WORD3;
+                    goto error;
+                req->version_slice.off = i;
+                state = HTTP_RECV_STATE_WORD3;
             break;
 
             case HTTP_RECV_STATE_WORD3:
-                if (c == '\n')
-                    con->recv_state = HTTP_RECV_STATE_LF;
-                else if (c == ' ' || c == '\t')
-                    return -1;
+                if (c == '\n') {
+                    end_slice(con, &req->version_slice, i);
+                    state = HTTP_RECV_STATE_LF;
+                } else if (c == ' ' || c == '\t')
+                    goto error;
             break;
 
             case HTTP_RECV_STATE_LF:
+                //空行，请求结束
+                if (c == '\n')
+                    goto done;
+                if (c == '\r')
+                    continue;
+                //头部名称不能为空，不支持以空白开头的折行
+                if (c == ':' || c == ' ' || c == '\t' || req->nheaders >= HTTP_REQUEST_HEADERS_MAX)
+                    goto error;
+                req->headers[req->nheaders].key.off = i;
+                state = HTTP_RECV_STATE_KEY;
+            break;
+
+            case HTTP_RECV_STATE_KEY:
+                if (c == ':') {
+                    end_slice(con, &req->headers[req->nheaders].key, i);
+                    state = HTTP_RECV_STATE_SP3;
+                } else if (!scan_is_token(c))
+                    goto error;
+            break;
+
+            case HTTP_RECV_STATE_SP3:
+                if (c == ' ' || c == '\t')
+                    continue;
+                req->headers[req->nheaders].value.off = i;
+                state = HTTP_RECV_STATE_VALUE;
+                if (c != '\n')
+                    break;
+                //值为空时当前字符就是行尾，继续按VALUE状态处理
+                /* fall through */
+
+            case HTTP_RECV_STATE_VALUE:
                 if (c == '\n') {
-                    con->request_len++;
-                    return 1;
-                } else if (c != '\r')
-                    con->recv_state = HTTP_RECV_STATE_LINE;
+                    h = &req->headers[req->nheaders++];
+                    end_slice(con, &h->value, i);
+                    state = HTTP_RECV_STATE_LF;
+                } else if (c != '\r' && c != '\t' && ((unsigned char) c < ' ' || c == 0x7f))
+                    goto error;
             break;
 
-            case HTTP_RECV_STATE_LINE:
-                if (c == '\n')
-                    con->recv_state = HTTP_RECV_STATE_LF;
+            case HTTP_RECV_STATE_DONE:
+            case HTTP_RECV_STATE_ERROR:
             break;
         }
     }
 
-    return 0;
-}
\ No newline at end of file
+    goto out;
+
+done:
+    i++;
+    state = HTTP_RECV_STATE_DONE;
+    ret = 1;
+    goto out;
+
+error:
+    state = HTTP_RECV_STATE_ERROR;
+    ret = -1;
+
+out:
+    //超过上限仍没有收完头部时不再等待，避免接收队列无限增长
+    if (ret == 0 && con->recv_buf->len > HTTP_REQUEST_SIZE_MAX) {
+        state = HTTP_RECV_STATE_ERROR;
+        con->status_code = 431;
+        ret = -1;
+    }
+
+    con->request_len = i;
+    con->recv_state = state;
+    return ret;
+}
@@ -9,9 +9,24 @@ http_request* http_request_init(void);
 // 释放HTTP请求
 void http_request_free(http_request *req);
 
-// 根据HTTP/1.0协议验证HTTP请求是否合法
+// 重置HTTP请求以便在同一连接上处理下一个请求
+void http_request_reset(http_request *req);
+
+// 按名称查找请求头部的值，名称不区分大小写，不存在返回NULL，只能在http_request_parse()之后调用
+const char* http_request_header(http_request *req, const char *key);
+
+// 请求头部的值是否包含逗号分隔的token，不区分大小写
+int http_request_has_token(http_request *req, const char *key, const char *token);
+
+// 根据HTTP版本和Connection头部判断客户端是否希望保持连接
+int http_request_keep_alive(http_request *req);
+
+// 增量检查请求是否已经完整接收，同时切分请求行和头部，格式错误或头部超过HTTP_REQUEST_SIZE_MAX返回-1
 int http_request_complete(connection *con);
 
+// 按字面规范化URI，结果写入con->real_path和con->rel_path，返回0成功，-1格式错误，-2越过了root
+int http_request_resolve_uri(connection *con, const char *root, const char *uri);
+
 // 解析HTTP请求
 void http_request_parse(server *serv, connection *con);
 
@@ -1,13 +1,19 @@
 #include <limits.h>
 #include <sys/stat.h>
-#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 
 #include "log.h"
 #include "http_header.h"
+#include "request.h"
 #include "response.h"
+#include "metrics.h"
 
 // 文件扩展名与MimeType数据结构
 typedef struct {
@@ -26,15 +32,16 @@ static mime mime_types[] = {
     {".png", "image/png"}
 };
 
-http_response* http_response_init() {
+http_response* http_response_init(arena *a) {
     //初始化响应，分配内存
     http_response *resp;
     resp = malloc(sizeof(*resp));
     memset(resp, 0, sizeof(*resp));
 
-    resp->headers = http_headers_init();
+    resp->headers = http_headers_init(a);
     resp->entity_body = string_init();
     resp->content_length = -1;
+    resp->body_fd = -1;
 
     return resp;
 }
@@ -45,62 +52,91 @@ void http_response_free(http_response *resp) {
     http_headers_free(resp->headers);
     string_free(resp->entity_body);
 
+    if (resp->body_fd > -1)
+        close(resp->body_fd);
+    cache_release(resp->cached);
+
     free(resp);
 }
 
+void http_response_reset(http_response *resp) {
+    http_headers_reset(resp->headers);
+    string_reset(resp->entity_body);
+
+    if (resp->body_fd > -1)
+        close(resp->body_fd);
+    cache_release(resp->cached);
+
+    resp->content_length = -1;
+    resp->body_fd = -1;
+    resp->body_mem = NULL;
+    resp->body_off = 0;
+    resp->body_left = 0;
+    resp->cached = NULL;
+    resp->mtime = 0;
+    resp->ino = 0;
+    resp->etag[0] = '\0';
+    resp->last_modified[0] = '\0';
+    resp->nranges = 0;
+}
+
 // 出错页面
-static char err_file[PATH_MAX];
 static const char *default_err_msg = "<HTML><HEAD><TITLE>Error</TITLE></HEAD>"
                                       "<BODY><H1>Something went wrong</H1>"
                                       "</BODY></HTML>";
 
+// 启动时预先生成响应的错误状态码
+static const int err_status_codes[] = {400, 403, 404, 416, 431, 500, 501, 503};
+
+// 预先生成的错误响应，以status_code为0的项结尾
+struct error_page {
+    int status_code;
+    // 完整的响应：状态行、头部和错误页面，Connection头部为close和keep-alive的各一份
+    char *data[2];
+    size_t len[2];
+    // 状态行和头部（包括结尾的空行）的长度
+    size_t head_len[2];
+    // Date的值在头部中的位置，发送时复制头部并替换为当前时间
+    size_t date_off;
+};
+
 //根据状态码构建响应结构中的状态消息
 static const char* reason_phrase(int status_code){
     switch (status_code) {
         case 200:
             return "OK";
+        case 206:
+            return "Partial Content";
+        case 304:
+            return "Not Modified";
         case 400:
             return "Bad Request";
         case 403:
             return "Forbidden";
         case 404:
             return "Not Found";
+        case 416:
+            return "Range Not Satisfiable";
+        case 431:
+            return "Request Header Fields Too Large";
         case 500:
             return "Internal Server Error";
         case 501:
             return "Not Implemented";
+        case 503:
+            return "Service Unavailable";
 
     }
 
     return "";
 }
 
-static int send_all(connection *con, string *buf){
-    int bytes_sent = 0;
-    int bytes_left = buf->len;
-    int nbytes = 0;
-
-    //把buf内容全部发送到客户端
-    while (bytes_sent < bytes_left) {
-        nbytes = send(con->sockfd, buf->ptr + bytes_sent, bytes_left, 0);
-        
-        if (nbytes == -1)
-            break;
-
-        bytes_sent += nbytes;
-        bytes_left -= nbytes;
-        
-    }
-
-    return nbytes != -1 ? bytes_sent : -1;
-}
-
-static const char* get_mime_type(const char *path, const char *default_mime){
+const char* http_response_mime_type(const char *path, const char *default_mime) {
     //路径长度
     size_t path_len = strlen(path);
 
     //逐个比较
-    for (size_t i = 0; i < sizeof(mime_types); i++) {
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
         size_t ext_len = strlen(mime_types[i].ext);
         const char *path_ext = path + path_len - ext_len;
         //如果存在MimeType则返回
@@ -112,22 +148,217 @@ static const char* get_mime_type(const char *path, const char *default_mime){
     return default_mime;
 }
 
-//检查文件权限是否可以访问
-static int check_file_attrs(connection *con, const char *path){
-    struct stat s;
-    con->response->content_length = -1;
-    //stat检查路径
-    if (stat(path, &s) == -1) {
-        con->status_code = 404;
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+// 内核不支持openat2()时置0，退回到realpath()确认后再打开
+static int has_openat2 = 1;
+
+/*
+ * 相对于Web文件目录打开请求的文件，解析路径时不允许越过该目录，也不跟随/proc中的魔术链接。
+ * 先不允许任何符号链接，失败时再跟随目录内的符号链接打开，并把*via_link置1：
+ * 缓存按字面路径查找，而inotify报告的是链接目标的路径，这样的文件不放入缓存
+ */
+static int open_beneath(server *serv, connection *con, int *via_link){
+    struct open_how how;
+    char resolved[PATH_MAX];
+    size_t root_len = con->rel_path - con->real_path;
+    int fd;
+
+    *via_link = 0;
+
+    if (has_openat2) {
+        memset(&how, 0, sizeof(how));
+        //O_NONBLOCK避免打开FIFO等特殊文件时阻塞
+        how.flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | RESOLVE_NO_SYMLINKS;
+        fd = syscall(SYS_openat2, serv->root_fd, con->rel_path, &how, sizeof(how));
+
+        if (fd == -1 && errno == ELOOP) {
+            *via_link = 1;
+            how.resolve &= ~RESOLVE_NO_SYMLINKS;
+            fd = syscall(SYS_openat2, serv->root_fd, con->rel_path, &how, sizeof(how));
+        }
+
+        if (fd != -1 || errno != ENOSYS)
+            return fd;
+        has_openat2 = 0;
+    }
+
+    // 规范化后的路径中已经没有'..'，只需确认符号链接没有指向目录之外
+    if (realpath(con->real_path, resolved) == NULL)
+        return -1;
+    if (strncmp(resolved, con->real_path, root_len) != 0) {
+        errno = EXDEV;
+        return -1;
+    }
+    *via_link = strcmp(resolved, con->real_path) != 0;
+
+    return open(resolved, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static int open_body(server *serv, connection *con, struct stat *s, int *via_link){
+    http_response *resp = con->response;
+    int fd;
+
+    resp->content_length = -1;
+    fd = open_beneath(serv, con, via_link);
+
+    if (fd == -1) {
+        con->status_code = (errno == EACCES) ? 403 : 404;
         return -1;
     }
     //S_ISREG检查是否常规文件
-    if (!S_ISREG(s.st_mode)) {
+    if (fstat(fd, s) == -1 || !S_ISREG(s->st_mode)) {
+        close(fd);
         con->status_code = 403;
         return -1;
     }
 
-    con->response->content_length = s.st_size;
+    resp->content_length = s->st_size;
+    resp->mtime = s->st_mtime;
+    resp->ino = s->st_ino;
+    resp->body_fd = fd;
+    resp->body_off = 0;
+    resp->body_left = s->st_size;
+
+    return 0;
+}
+
+//把时间格式化为HTTP日期
+static void format_http_date(char *buf, size_t size, time_t t){
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// 当前时间的HTTP日期，每个线程每秒最多格式化一次
+static __thread time_t date_time;
+static __thread char date_buf[CACHE_DATE_SIZE];
+
+static const char* http_date_now(){
+    time_t now = time(NULL);
+
+    if (now != date_time) {
+        date_time = now;
+        format_http_date(date_buf, sizeof(date_buf), now);
+    }
+    return date_buf;
+}
+
+//解析HTTP日期，只接受RFC 7231推荐的IMF-fixdate格式
+static int parse_http_date(const char *value, time_t *t){
+    const char *end;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if (!end || *end != '\0')
+        return -1;
+
+    *t = timegm(&tm);
+    return 0;
+}
+
+//由stat()得到的inode、大小和修改时间生成强验证器ETag和Last-Modified
+static void make_validators(http_response *resp, const struct stat *s){
+    snprintf(resp->etag, sizeof(resp->etag), "\"%lx-%llx-%llx\"",
+             (unsigned long) s->st_ino, (unsigned long long) s->st_size,
+             (unsigned long long) s->st_mtime);
+    format_http_date(resp->last_modified, sizeof(resp->last_modified), s->st_mtime);
+}
+
+//HEAD请求等不需要发送文件内容的情况，同时释放缓存项的引用
+static void drop_body(http_response *resp){
+    if (resp->body_fd > -1)
+        close(resp->body_fd);
+    cache_release(resp->cached);
+    resp->body_fd = -1;
+    resp->body_mem = NULL;
+    resp->body_left = 0;
+    resp->cached = NULL;
+}
+
+//使用缓存中的文件内容作为响应内容
+static void use_cached(http_response *resp, cache_entry *e){
+    if (resp->body_fd > -1)
+        close(resp->body_fd);
+
+    resp->cached = e;
+    resp->body_fd = -1;
+    resp->body_mem = e->body;
+    resp->body_off = 0;
+    resp->body_left = e->size;
+    resp->content_length = e->size;
+    resp->mtime = e->mtime;
+    resp->ino = e->ino;
+    //验证器在加入缓存时已经生成
+    memcpy(resp->etag, e->etag, sizeof(resp->etag));
+    memcpy(resp->last_modified, e->last_modified, sizeof(resp->last_modified));
+}
+
+// 预先生成的头部中Date之前的部分，Date的值从HEAD_DATE_OFF开始，长度固定为HTTP_DATE_LEN
+#define HEAD_PREFIX "HTTP/1.1 200 OK\r\nServer: cserver\r\nDate: "
+#define HEAD_DATE_OFF (sizeof(HEAD_PREFIX) - 1)
+#define HTTP_DATE_LEN 29
+
+// 为缓存项生成发送整个文件时的状态行和头部，与send_response()逐个添加的头部相同
+static void make_cached_head(cache_entry *e){
+    char buf[1024];
+    int n;
+
+    for (int k = 0; k < 2; k++) {
+        n = snprintf(buf, sizeof(buf),
+                     HEAD_PREFIX "%s\r\n"
+                     "Connection: %s\r\n"
+                     "ETag: %s\r\n"
+                     "Last-Modified: %s\r\n"
+                     "Accept-Ranges: bytes\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %lld\r\n\r\n",
+                     http_date_now(), k ? "keep-alive" : "close", e->etag,
+                     e->last_modified, e->mime, (long long) e->size);
+
+        if (n < 0 || (size_t) n >= sizeof(buf))
+            continue;
+        e->head[k] = malloc(n);
+        memcpy(e->head[k], buf, n);
+        e->head_len[k] = n;
+    }
+}
+
+//准备200响应的文件内容，优先使用缓存，未命中时打开文件并尝试加入缓存
+static int prepare_body(server *serv, connection *con, const char **mime){
+    http_response *resp = con->response;
+    cache_entry *e;
+    struct stat s;
+    int via_link;
+
+    if (serv->cache && (e = cache_lookup(serv->cache, con->real_path)) != NULL) {
+        metrics_cache(1);
+        use_cached(resp, e);
+        *mime = e->mime;
+        return 0;
+    }
+
+    if (serv->cache)
+        metrics_cache(0);
+
+    if (open_body(serv, con, &s, &via_link) == -1)
+        return -1;
+
+    *mime = http_response_mime_type(con->real_path, "text/plain");
+    make_validators(resp, &s);
+
+    if (serv->cache && !via_link && (e = cache_insert(serv->cache, con->real_path, resp->body_fd, &s, *mime)) != NULL) {
+        memcpy(e->etag, resp->etag, sizeof(e->etag));
+        memcpy(e->last_modified, resp->last_modified, sizeof(e->last_modified));
+        make_cached_head(e);
+        use_cached(resp, e);
+    }
 
     return 0;
 }
@@ -161,28 +392,84 @@ static int read_file(string *buf, const char *path){
     return fsize;
 }
 
-//读取标准错误页面
-static int read_err_file(server *serv, connection *con, string *buf){
-    //打印错误文件
-    snprintf(err_file, sizeof(err_file), "%s/%d.html", serv->conf->doc_root, con->status_code);
+//生成状态码对应的完整错误响应，Date的值在发送时替换，503响应带有Retry-After
+static void make_error_page(error_page *page, int status_code, string *body, int retry_after){
+    string *buf;
+
+    page->status_code = status_code;
+
+    for (int k = 0; k < 2; k++) {
+        buf = string_init();
+        string_append(buf, "HTTP/1.1 ");
+        string_append_int(buf, status_code);
+        string_append_ch(buf, ' ');
+        string_append(buf, reason_phrase(status_code));
+        string_append(buf, "\r\nServer: cserver\r\nDate: ");
+        page->date_off = buf->len;
+        string_append(buf, http_date_now());
+        string_append(buf, "\r\n");
+        if (status_code == 503) {
+            string_append(buf, "Retry-After: ");
+            string_append_int(buf, retry_after);
+            string_append(buf, "\r\n");
+        }
+        string_append(buf, "Connection: ");
+        string_append(buf, k ? "keep-alive" : "close");
+        string_append(buf, "\r\nContent-Type: text/html\r\nContent-Length: ");
+        string_append_long(buf, body->len);
+        string_append(buf, "\r\n\r\n");
+
+        page->head_len[k] = buf->len;
+        string_append_string(buf, body);
+        page->len[k] = buf->len;
+
+        //接管字符串的存储区域
+        page->data[k] = buf->ptr;
+        free(buf);
+    }
+}
+
+void http_response_load_errors(server *serv) {
+    size_t n = sizeof(err_status_codes) / sizeof(err_status_codes[0]);
+    char err_file[PATH_MAX];
+    string *body = string_init();
 
-    int len = read_file(buf, err_file);
+    serv->err_pages = calloc(n + 1, sizeof(error_page));
 
-    //如果文件不存在则使用默认的出错信息字符串替代
-    if (len <= 0) {
-        string_append(buf, default_err_msg);
-        len = buf->len;
+    for (size_t i = 0; i < n; i++) {
+        snprintf(err_file, sizeof(err_file), "%s/%d.html", serv->conf->doc_root, err_status_codes[i]);
+
+        //如果文件不存在则使用默认的出错信息字符串替代
+        string_reset(body);
+        if (read_file(body, err_file) <= 0) {
+            log_error(serv, "failed to open file %s", err_file);
+            string_reset(body);
+            string_append(body, default_err_msg);
+        }
+
+        make_error_page(&serv->err_pages[i], err_status_codes[i], body, serv->conf->retry_after);
     }
 
-    return len;
+    string_free(body);
+}
+
+void http_response_free_errors(server *serv) {
+    if (!serv->err_pages) return;
+
+    for (error_page *page = serv->err_pages; page->status_code; page++) {
+        free(page->data[0]);
+        free(page->data[1]);
+    }
+    free(serv->err_pages);
+    serv->err_pages = NULL;
 }
 
-static void build_and_send_response(connection *con){
-    //初始化发送的字符串
-    string *buf = string_init();
+static void build_response(connection *con){
+    //响应追加到连接的发送队列中
+    string *buf = con->send_buf;
     http_response *resp = con->response;
     //添加版本协议并换行
-    string_append(buf, "HTTP/1.0 ");
+    string_append(buf, "HTTP/1.1 ");
     string_append_int(buf, con->status_code);
     string_append_ch(buf, ' ');
     string_append(buf, reason_phrase(con->status_code));
@@ -198,78 +485,444 @@ static void build_and_send_response(connection *con){
 
     string_append(buf, "\r\n");
     
-    //HTTP 身体
-    if (resp->content_length > 0 && con->request->method != HTTP_METHOD_HEAD) {
+    //HTTP 身体，文件内容不在缓存中而是由连接通过sendfile()发送
+    if (resp->entity_body->len > 0 && con->request->method != HTTP_METHOD_HEAD) {
         string_append_string(buf, resp->entity_body);
     }
 
-    // 将字符串缓存发送到客户端
-    send_all(con, buf);
-    string_free(buf);
 }
 
-static void send_err_response(server *serv, connection *con){
+//查找状态码对应的预先生成的错误响应
+static const error_page* find_error_page(server *serv, int status_code){
+    for (error_page *page = serv->err_pages; page && page->status_code; page++) {
+        if (page->status_code == status_code)
+            return page;
+    }
+    return NULL;
+}
+
+size_t http_response_error_head(server *serv, int status_code, char *buf, size_t size,
+                                 const char **body, size_t *body_len) {
+    const error_page *page = find_error_page(serv, status_code);
+
+    if (!page || page->head_len[0] > size)
+        return 0;
+
+    memcpy(buf, page->data[0], page->head_len[0]);
+    memcpy(buf + page->date_off, http_date_now(), HTTP_DATE_LEN);
+    *body = page->data[0] + page->head_len[0];
+    *body_len = page->len[0] - page->head_len[0];
+
+    return page->head_len[0];
+}
+
+//没有预先生成的状态码，使用默认的出错信息构建响应
+static void send_default_err_response(connection *con){
     http_response *resp = con->response;
-    snprintf(err_file, sizeof(err_file), "%s/%d.html", serv->conf->doc_root, con->status_code);
 
-    // 检查错误页面
-    if (check_file_attrs(con, err_file) == -1) {
-        resp->content_length = strlen(default_err_msg);
-        log_error(serv, "failed to open file %s", err_file);
-    }
+    resp->content_length = strlen(default_err_msg);
+    string_append(resp->entity_body, default_err_msg);
 
-    // 构建消息头部
+    http_headers_add(resp->headers, "Server", "cserver");
+    http_headers_add(resp->headers, "Date", http_date_now());
+    http_headers_add(resp->headers, "Connection", con->keep_alive ? "keep-alive" : "close");
     http_headers_add(resp->headers, "Content-Type", "text/html");
     http_headers_add_int(resp->headers, "Content-Length", resp->content_length);
 
-    if (con->request->method != HTTP_METHOD_HEAD) {
-       read_err_file(serv, con, resp->entity_body); 
+    build_response(con);
+}
+
+//错误响应使用预先生成的响应，不访问文件系统：复制头部并替换Date的值，错误页面直接从预先生成的内存发送，
+//resp->headers中的头部插入到空行之前
+static void send_err_response(server *serv, connection *con){
+    http_response *resp = con->response;
+    const error_page *page = find_error_page(serv, con->status_code);
+    int k = con->keep_alive ? 1 : 0;
+    int head = con->request->method == HTTP_METHOD_HEAD;
+    int extra = resp->headers->len > 0;
+    size_t start = con->send_buf->len;
+
+    if (!page) {
+        send_default_err_response(con);
+        return;
+    }
+
+    //错误页面代替文件内容发送，释放已经打开的文件或缓存项
+    drop_body(resp);
+    resp->content_length = page->len[k] - page->head_len[k];
+    resp->body_mem = page->data[k];
+    resp->body_off = page->head_len[k];
+    resp->body_left = head ? 0 : resp->content_length;
+
+    //有附加的头部时去掉结尾的空行
+    string_append_len(con->send_buf, page->data[k], page->head_len[k] - (extra ? 2 : 0));
+    memcpy(con->send_buf->ptr + start + page->date_off, http_date_now(), HTTP_DATE_LEN);
+    if (!extra)
+        return;
+
+    for (size_t i = 0; i < resp->headers->len; i++) {
+        string_append_string(con->send_buf, resp->headers->ptr[i].key);
+        string_append(con->send_buf, ": ");
+        string_append_string(con->send_buf, resp->headers->ptr[i].value);
+        string_append(con->send_buf, "\r\n");
     }
+    string_append(con->send_buf, "\r\n");
+}
+
+//解析不带符号的十进制数，返回数字之后的位置，没有数字或溢出时返回NULL
+static const char* parse_offset(const char *p, off_t *val){
+    off_t v = 0;
+
+    if (!isdigit((unsigned char) *p))
+        return NULL;
+
+    for (; isdigit((unsigned char) *p); p++) {
+        if (v > (LLONG_MAX - (*p - '0')) / 10)
+            return NULL;
+        v = v * 10 + (*p - '0');
+    }
+
+    *val = v;
+    return p;
+}
+
+//解析Range头部中文件大小为size时可以满足的字节范围，返回范围数，头部无效或范围过多时返回-1
+static int parse_ranges(const char *value, off_t size, http_range *ranges){
+    const char *p = value;
+    off_t first, last;
+    int specs = 0;
+    int n = 0;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (strncasecmp(p, "bytes", 5) != 0)
+        return -1;
+    p += 5;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p++ != '=')
+        return -1;
+
+    while (1) {
+        //列表中允许空元素
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+
+        if (*p == '-') {
+            //"-N"表示最后N个字节
+            if (!(p = parse_offset(p + 1, &last)))
+                return -1;
+            first = size > last ? size - last : 0;
+            last = size - 1;
+            if (first > last)
+                first = size;
+        } else {
+            //"A-B"或"A-"
+            if (!(p = parse_offset(p, &first)) || *p++ != '-')
+                return -1;
+            if (isdigit((unsigned char) *p)) {
+                if (!(p = parse_offset(p, &last)) || last < first)
+                    return -1;
+                if (last > size - 1)
+                    last = size - 1;
+            } else {
+                last = size - 1;
+            }
+        }
+
+        if (++specs > HTTP_RANGES_MAX)
+            return -1;
+
+        //起始位置超出文件的范围不能满足，忽略
+        if (first < size) {
+            ranges[n].off = first;
+            ranges[n].len = last - first + 1;
+            ranges[n].head_end = 0;
+            n++;
+        }
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p != ',' && *p != '\0')
+            return -1;
+    }
+
+    return specs > 0 ? n : -1;
+}
+
+//比较实体标签，弱比较时忽略W/前缀，强比较时弱标签不匹配任何标签
+static int etag_equal(const char *tag, size_t len, const char *etag, int weak){
+    if (len >= 2 && strncmp(tag, "W/", 2) == 0) {
+        if (!weak)
+            return 0;
+        tag += 2;
+        len -= 2;
+    }
+
+    return strlen(etag) == len && strncmp(tag, etag, len) == 0;
+}
+
+//If-None-Match中的实体标签列表是否包含etag，"*"匹配任何存在的文件
+static int etag_list_match(const char *list, const char *etag){
+    const char *p = list;
+    const char *end;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+
+        if (*p == '*')
+            return 1;
+
+        //实体标签的引号中不能包含逗号
+        for (end = p; *end && *end != ',' && *end != ' ' && *end != '\t'; end++)
+            ;
+
+        if (etag_equal(p, end - p, etag, 1))
+            return 1;
+        p = end;
+    }
+
+    return 0;
+}
+
+//If-None-Match或If-Modified-Since表明客户端的副本仍然有效时返回1
+static int not_modified(http_request *req, http_response *resp){
+    const char *value;
+    time_t t;
+
+    if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+        return 0;
+
+    //两者都有时只看If-None-Match
+    if ((value = http_request_header(req, "If-None-Match")) != NULL)
+        return etag_list_match(value, resp->etag);
+
+    if ((value = http_request_header(req, "If-Modified-Since")) != NULL)
+        return parse_http_date(value, &t) == 0 && resp->mtime <= t;
+
+    return 0;
+}
+
+//If-Range中的ETag或日期与文件一致时才发送部分内容，ETag使用强比较
+static int if_range_match(http_request *req, http_response *resp){
+    const char *value = http_request_header(req, "If-Range");
+    time_t t;
+
+    if (!value)
+        return 1;
+
+    if (value[0] == '"' || value[0] == 'W')
+        return etag_equal(value, strlen(value), resp->etag, 0);
+
+    return parse_http_date(value, &t) == 0 && t == resp->mtime;
+}
+
+//根据Range头部选择要发送的范围，返回范围数，0表示发送整个文件，-1表示范围不能满足
+static int prepare_ranges(connection *con, off_t size){
+    http_request *req = con->request;
+    http_response *resp = con->response;
+    const char *value;
+    int n;
+
+    //只有GET请求需要处理Range，无效的Range头部按没有处理
+    if (req->method != HTTP_METHOD_GET || !(value = http_request_header(req, "Range")))
+        return 0;
+
+    if ((n = parse_ranges(value, size, resp->ranges)) == -1 || !if_range_match(req, resp))
+        return 0;
 
-    build_and_send_response(con);
+    return n > 0 ? n : -1;
+}
+
+static void add_content_range(http_headers *headers, off_t off, off_t len, off_t size){
+    char value[80];
+
+    if (len > 0)
+        snprintf(value, sizeof(value), "bytes %lld-%lld/%lld",
+                 (long long) off, (long long) (off + len - 1), (long long) size);
+    else
+        snprintf(value, sizeof(value), "bytes */%lld", (long long) size);
+
+    http_headers_add(headers, "Content-Range", value);
+}
+
+//多段响应：各段之前是分段头部，最后是结束边界，分段头部放在send_buf中由连接与文件内容交替发送
+static void send_multipart_response(connection *con, const char *mime, off_t size, int n){
+    http_response *resp = con->response;
+    string *parts = string_init_arena(con->arena);
+    char boundary[40];
+    char type[80];
+    size_t base;
+    off_t total = 0;
+
+    //边界由文件标识生成，每个文件不同
+    snprintf(boundary, sizeof(boundary), "%lx%lx", (unsigned long) resp->ino, (unsigned long) resp->mtime);
+    snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s", boundary);
+
+    for (int i = 0; i < n; i++) {
+        http_range *r = &resp->ranges[i];
+
+        string_append(parts, "\r\n--");
+        string_append(parts, boundary);
+        string_append(parts, "\r\nContent-Type: ");
+        string_append(parts, mime);
+        string_append(parts, "\r\nContent-Range: bytes ");
+        string_append_long(parts, r->off);
+        string_append_ch(parts, '-');
+        string_append_long(parts, r->off + r->len - 1);
+        string_append_ch(parts, '/');
+        string_append_long(parts, size);
+        string_append(parts, "\r\n\r\n");
+
+        r->head_end = parts->len;
+        total += r->len;
+    }
+
+    string_append(parts, "\r\n--");
+    string_append(parts, boundary);
+    string_append(parts, "--\r\n");
+
+    resp->content_length = total + parts->len;
+
+    http_headers_add(resp->headers, "Content-Type", type);
+    http_headers_add_int(resp->headers, "Content-Length", resp->content_length);
+
+    build_response(con);
+
+    //分段头部在send_buf中的位置
+    base = con->send_buf->len;
+    string_append_string(con->send_buf, parts);
+    for (int i = 0; i < n; i++)
+        resp->ranges[i].head_end += base;
+    resp->nranges = n;
+
+    string_free(parts);
+}
+
+// 所有文件响应都有的头部
+static void add_common_headers(connection *con){
+    http_headers *headers = con->response->headers;
+
+    http_headers_add(headers, "Server", "cserver");
+    http_headers_add(headers, "Date", http_date_now());
+    http_headers_add(headers, "Connection", con->keep_alive ? "keep-alive" : "close");
+    http_headers_add(headers, "ETag", con->response->etag);
+    http_headers_add(headers, "Last-Modified", con->response->last_modified);
+}
+
+// 复制缓存项中预先生成的头部，只替换Date的值
+static int send_cached_head(connection *con, cache_entry *e){
+    int k = con->keep_alive ? 1 : 0;
+    size_t start = con->send_buf->len;
+
+    if (!e->head[k])
+        return -1;
+
+    string_append_len(con->send_buf, e->head[k], e->head_len[k]);
+    memcpy(con->send_buf->ptr + start + HEAD_DATE_OFF, http_date_now(), HTTP_DATE_LEN);
+    return 0;
 }
 
 static void send_response(server *serv, connection *con){
     http_response *resp = con->response;
     http_request *req = con->request;
+    const char *mime;
+    off_t size;
+    int n;
     
-    http_headers_add(resp->headers, "Server", "cserver");
-
     if (con->status_code != 200) {
         send_err_response(serv, con);
         return;
     }
 
-    if (check_file_attrs(con, con->real_path) == -1) {
+    if (prepare_body(serv, con, &mime) == -1) {
+        send_err_response(serv, con);
+        return;
+    }
+
+    //客户端缓存的副本仍然有效，只发送头部
+    if (not_modified(req, resp)) {
+        drop_body(resp);
+        con->status_code = 304;
+        resp->content_length = -1;
+        add_common_headers(con);
+        build_response(con);
+        return;
+    }
+
+    size = resp->content_length;
+    n = prepare_ranges(con, size);
+
+    //没有一个范围可以满足
+    if (n == -1) {
+        drop_body(resp);
+        con->status_code = 416;
+        add_content_range(resp->headers, 0, 0, size);
         send_err_response(serv, con);
         return;
     }
 
-    if (req->method != HTTP_METHOD_HEAD) {
-        read_file(resp->entity_body, con->real_path);
+    //发送缓存中的整个文件时头部都已经生成好
+    if (n == 0 && resp->cached && send_cached_head(con, resp->cached) == 0) {
+        if (req->method == HTTP_METHOD_HEAD)
+            drop_body(resp);
+        return;
+    }
+
+    add_common_headers(con);
+
+    if (n > 1) {
+        con->status_code = 206;
+        send_multipart_response(con, mime, size, n);
+        return;
+    }
+
+    if (n == 1) {
+        //只发送文件中请求的一段
+        con->status_code = 206;
+        resp->body_off += resp->ranges[0].off;
+        resp->body_left = resp->ranges[0].len;
+        resp->content_length = resp->ranges[0].len;
+        add_content_range(resp->headers, resp->ranges[0].off, resp->ranges[0].len, size);
+    } else {
+        http_headers_add(resp->headers, "Accept-Ranges", "bytes");
+    }
+
+    if (req->method == HTTP_METHOD_HEAD) {
+        drop_body(resp);
     }
 
     // 构建消息头部
-    const char *mime = get_mime_type(con->real_path, "text/plain");
     http_headers_add(resp->headers, "Content-Type", mime);
     http_headers_add_int(resp->headers, "Content-Length", resp->content_length);
 
-    build_and_send_response(con);
+    build_response(con);
 }
 
 static void send_http09_response(server *serv, connection *con){
     http_response *resp = con->response;
+    const error_page *page;
+    const char *mime;
 
-    if (con->status_code == 200 && check_file_attrs(con, con->real_path) == 0) {
-        read_file(resp->entity_body, con->real_path);
-    } else {
-        read_err_file(serv, con, resp->entity_body);
+    // 文件内容由连接直接发送，出错时只发送预先生成的错误页面内容
+    if (con->status_code != 200 || prepare_body(serv, con, &mime) == -1) {
+        if ((page = find_error_page(serv, con->status_code)) != NULL) {
+            drop_body(resp);
+            resp->body_mem = page->data[0];
+            resp->body_off = page->head_len[0];
+            resp->body_left = page->len[0] - page->head_len[0];
+        } else {
+            string_append(con->send_buf, default_err_msg);
+        }
     }
-
-    send_all(con, resp->entity_body);
 }
 
-void http_response_send(server *serv, connection *con) {
+void http_response_build(server *serv, connection *con) {
     if (con->request->version == HTTP_VERSION_09) {
         send_http09_response(serv, con);
     } else {
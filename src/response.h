@@ -3,13 +3,30 @@
 
 #include "server.h"
 
-// 初始化HTTP响应
-http_response* http_response_init();
+// 初始化HTTP响应，头部从内存区a分配，a可以为NULL
+http_response* http_response_init(arena *a);
 
 // 释放HTTP响应
 void http_response_free(http_response *resp);
 
-// 发送HTTP响应
-void http_response_send(server *serv, connection *con);
+// 重置HTTP响应以便在同一连接上发送下一个响应
+void http_response_reset(http_response *resp);
+
+// 读入Web目录中的错误页面，生成完整的错误响应
+void http_response_load_errors(server *serv);
+
+// 把预先生成的错误响应（Connection: close）的头部复制到buf中并替换Date的值，返回头部长度，
+// 错误页面的位置和长度保存在body和body_len中。没有对应的响应或buf不够大时返回0
+size_t http_response_error_head(server *serv, int status_code, char *buf, size_t size,
+                                const char **body, size_t *body_len);
+
+// 释放预先生成的错误响应
+void http_response_free_errors(server *serv);
+
+// 按扩展名查找文件的MimeType，没有匹配时返回default_mime
+const char* http_response_mime_type(const char *path, const char *default_mime);
+
+// 构建HTTP响应，结果追加到连接的发送队列中
+void http_response_build(server *serv, connection *con);
 
 #endif
\ No newline at end of file
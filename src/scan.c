@@ -0,0 +1,195 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "scan.h"
+
+// RFC 7230中的token字符表
+static const unsigned char token_map[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1,
+    ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1,
+    ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1,
+    ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1,
+    ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1,
+    ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1,
+    ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1,
+    ['y'] = 1, ['z'] = 1,
+};
+
+int scan_is_token(unsigned char c) {
+    return token_map[c];
+}
+
+static int is_uri_stop(unsigned char c){
+    return c <= ' ' || c == 0x7f;
+}
+
+static int is_value_stop(unsigned char c){
+    return (c < ' ' && c != '\t') || c == 0x7f;
+}
+
+/*
+ * 逐字节的实现
+ */
+
+static size_t scalar_token(const char *p, size_t len){
+    size_t i = 0;
+
+    while (i < len && token_map[(unsigned char) p[i]])
+        i++;
+    return i;
+}
+
+static size_t scalar_uri(const char *p, size_t len){
+    size_t i = 0;
+
+    while (i < len && !is_uri_stop(p[i]))
+        i++;
+    return i;
+}
+
+static size_t scalar_value(const char *p, size_t len){
+    size_t i = 0;
+
+    while (i < len && !is_value_stop(p[i]))
+        i++;
+    return i;
+}
+
+/*
+ * SSE4.2：pcmpestri在16个字节中查找落在给定字符范围内的第一个字节
+ * 范围最多8对，token的范围把'|'和'~'也当作停止字符，由调用者逐字节确认
+ */
+
+#define SSE42_RANGES (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT)
+
+__attribute__((target("sse4.2")))
+static size_t sse42_find(const char *p, size_t len, const char *ranges, int nranges,
+                         int (*stop)(unsigned char)){
+    __m128i r = _mm_loadu_si128((const __m128i *) ranges);
+    size_t i = 0;
+    int idx;
+
+    for (; i + 16 <= len; i += 16) {
+        idx = _mm_cmpestri(r, nranges, _mm_loadu_si128((const __m128i *) (p + i)), 16, SSE42_RANGES);
+        if (idx != 16)
+            return i + idx;
+    }
+
+    while (i < len && !stop(p[i]))
+        i++;
+    return i;
+}
+
+static int is_not_token(unsigned char c){
+    return !token_map[c];
+}
+
+// 16字节对齐读入，长度不足的部分不参与比较
+static const char token_ranges[16] __attribute__((aligned(16))) =
+    "\x00 \"\"(),,//:@[]{\xff";
+static const char uri_ranges[16] __attribute__((aligned(16))) = "\x00 \x7f\x7f";
+static const char value_ranges[16] __attribute__((aligned(16))) = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2")))
+static size_t sse42_token(const char *p, size_t len){
+    return sse42_find(p, len, token_ranges, 16, is_not_token);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_uri(const char *p, size_t len){
+    return sse42_find(p, len, uri_ranges, 4, is_uri_stop);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_value(const char *p, size_t len){
+    return sse42_find(p, len, value_ranges, 6, is_value_stop);
+}
+
+/*
+ * AVX2：一次检查32个字节，得到停止字符的位掩码
+ */
+
+// token字符按低4位查表得到高4位(0-7)的位图，高4位大于7的都不是token字符
+__attribute__((target("avx2")))
+static __m256i avx2_token_stop(__m256i v){
+    const __m256i lo_map = _mm256_setr_epi8(
+        0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+        0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70);
+    const __m256i hi_bit = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+        1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i bits = _mm256_and_si256(_mm256_shuffle_epi8(lo_map, lo), _mm256_shuffle_epi8(hi_bit, hi));
+
+    return _mm256_cmpeq_epi8(bits, _mm256_setzero_si256());
+}
+
+// 小于等于0x20或等于0x7f
+__attribute__((target("avx2")))
+static __m256i avx2_uri_stop(__m256i v){
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(' ')), v);
+    __m256i del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f));
+
+    return _mm256_or_si256(ctl, del);
+}
+
+// 小于0x20但不是HTAB，或等于0x7f
+__attribute__((target("avx2")))
+static __m256i avx2_value_stop(__m256i v){
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+    __m256i tab = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f));
+
+    return _mm256_or_si256(_mm256_andnot_si256(tab, ctl), del);
+}
+
+#define AVX2_SCAN(name, classify, scalar)                                          \
+__attribute__((target("avx2")))                                                    \
+static size_t name(const char *p, size_t len){                                     \
+    size_t i = 0;                                                                  \
+    unsigned int mask;                                                             \
+                                                                                   \
+    for (; i + 32 <= len; i += 32) {                                               \
+        mask = _mm256_movemask_epi8(classify(_mm256_loadu_si256((const __m256i *) (p + i)))); \
+        if (mask)                                                                  \
+            return i + __builtin_ctz(mask);                                        \
+    }                                                                              \
+                                                                                   \
+    return i + scalar(p + i, len - i);                                             \
+}
+
+AVX2_SCAN(avx2_token, avx2_token_stop, scalar_token)
+AVX2_SCAN(avx2_uri, avx2_uri_stop, scalar_uri)
+AVX2_SCAN(avx2_value, avx2_value_stop, scalar_value)
+
+static const scan_impl scalar_impl = {"scalar", scalar_token, scalar_uri, scalar_value};
+static const scan_impl sse42_impl = {"sse4.2", sse42_token, sse42_uri, sse42_value};
+static const scan_impl avx2_impl = {"avx2", avx2_token, avx2_uri, avx2_value};
+
+const scan_impl *scan = &scalar_impl;
+
+const scan_impl* scan_find_impl(const char *name) {
+    __builtin_cpu_init();
+
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2") ? &avx2_impl : NULL;
+    if (strcmp(name, "sse4.2") == 0)
+        return __builtin_cpu_supports("sse4.2") ? &sse42_impl : NULL;
+    if (strcmp(name, "scalar") == 0)
+        return &scalar_impl;
+
+    return NULL;
+}
+
+void scan_init(void) {
+    const scan_impl *impl;
+
+    if ((impl = scan_find_impl("avx2")) != NULL || (impl = scan_find_impl("sse4.2")) != NULL)
+        scan = impl;
+}
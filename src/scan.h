@@ -0,0 +1,30 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// 请求解析中的字符扫描，一次检查多个字节
+// 每个函数返回p[0..len)中第一个需要逐字节处理的字符的位置，没有时返回len
+typedef struct {
+    const char *name;
+    // 第一个不是token字符的位置（头部名称）
+    size_t (*token)(const char *p, size_t len);
+    // 第一个空白或控制字符的位置（URI）
+    size_t (*uri)(const char *p, size_t len);
+    // 第一个除HTAB外的控制字符的位置（头部的值）
+    size_t (*value)(const char *p, size_t len);
+} scan_impl;
+
+// 当前使用的实现，scan_init()之前为逐字节的实现
+extern const scan_impl *scan;
+
+// 根据CPU支持的指令集选择最快的实现：AVX2、SSE4.2或逐字节
+void scan_init(void);
+
+// 按名称查找实现："avx2"、"sse4.2"或"scalar"，CPU不支持时返回NULL
+const scan_impl* scan_find_impl(const char *name);
+
+// 是否是RFC 7230中的token字符
+int scan_is_token(unsigned char c);
+
+#endif
@@ -18,18 +18,27 @@
 
 #include "server.h"
 #include "log.h"
+#include "response.h"
 #include "connection.h"
 #include "config.h"
+#include "event.h"
+#include "listener.h"
+#include "prefork.h"
+#include "reactor.h"
+#include "uring.h"
+#include "scan.h"
+#include "metrics.h"
+#include "admission.h"
 
 // 默认端口号
 #define DEFAULT_PORT 8080
-#define BACKLOG 10
 
 static server* server_init(){
     server *serv;
     //分配内存并初始化
     serv = malloc(sizeof(*serv));
     memset(serv, 0, sizeof(*serv));
+    serv->root_fd = -1;
     return serv;
 }
 
@@ -42,7 +51,7 @@ static void jail_server(server *serv, char *logfile, const char *chroot_path){
     // 检查web文件目录是否在根目录下
     if (root_len < doc_len && strncmp(chroot_path, serv->conf->doc_root, root_len) == 0) {
         // 更新web文件目录为根目录的相对路径
-        strncpy(serv->conf->doc_root, &serv->conf->doc_root[0] + root_len, doc_len - root_len + 1);
+        memmove(serv->conf->doc_root, serv->conf->doc_root + root_len, doc_len - root_len + 1);
     } else {
         fprintf(stderr, "document root %s is not a sub-directory in chroot %s\n", serv->conf->doc_root, chroot_path);
         exit(1);
@@ -54,7 +63,7 @@ static void jail_server(server *serv, char *logfile, const char *chroot_path){
             fprintf(stderr, "warning: log file is not an absolute path, opening it will fail if it's not in chroot\n");
         else if (root_len < log_len && strncmp(chroot_path, logfile, root_len) == 0) {
             // 更新日志文件为chroot_path的相对路径
-            strncpy(logfile, logfile + root_len, log_len - root_len + 1);
+            memmove(logfile, logfile + root_len, log_len - root_len + 1);
         } else {
             fprintf(stderr, "log file %s is not in chroot\n", logfile);
             exit(1);
@@ -136,48 +145,11 @@ static void daemonize(server *serv, int null_fd){
     log_info(serv, "pid: %d", getpid());
 }
 
-static void bind_and_listen(server *serv){
-    struct sockaddr_in serv_addr;
-    // 创建socket，ipv4,tcp
-    serv->sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    //创建失败，写入日志
-    if (serv->sockfd < 0) {
-        perror("socket");
-        log_error(serv, "socket: %s", strerror(errno));
-        exit(1);
-    }
-
-    int yes = 0;
-    //设置套接口SO_REUSEADDR许套接口和一个已在使用中的地址捆绑
-    if ((setsockopt(serv->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
-        log_error(serv, "socket: %s", strerror(errno));
-        exit(1);
-    }
-
-    //初始化服务器地址
-    memset(&serv_addr, 0, sizeof serv_addr);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(serv->port);
-
-    // bind() 绑定
-    if (bind(serv->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        perror("bind");
-        log_error(serv, "bind: %s", strerror(errno));
-        exit(1);
-    }
-
-    // listen() 监听，等待客户端连接
-    if (listen(serv->sockfd, BACKLOG) < 0) {
-        perror("listen");
-        log_error(serv, "listen: %s", strerror(errno));
-        exit(1);
-    }
-}
-
-
 static void server_free(server *serv) {
+    cache_free(serv->cache);
+    http_response_free_errors(serv);
+    if (serv->root_fd != -1)
+        close(serv->root_fd);
     config_free(serv->conf);
     free(serv);
 }
@@ -189,6 +161,11 @@ static void start_server(server *serv, const char *config, const char *chroot_pa
     serv->conf = config_init();
     config_load(serv->conf, config);
 
+    // 命令行指定的并发模型优先于配置文件
+    if (serv->mode != -1) {
+        serv->conf->mode = serv->mode;
+    }
+
     // 2. 设置端口号
     if (serv->port == 0 && serv->conf->port != 0) {
         serv->port = serv->conf->port;
@@ -217,7 +194,34 @@ static void start_server(server *serv, const char *config, const char *chroot_pa
     }
 
     // 6. 绑定并监听
-    bind_and_listen(serv);
+    listener_open(serv, serv->conf->mode == SERVER_MODE_PREFORK ||
+                        serv->conf->mode == SERVER_MODE_THREADS);
+
+    // 7. 创建文件内容缓存，fork模式下子进程处理完一个请求就退出，缓存没有意义
+    if (serv->conf->mode != SERVER_MODE_FORK && serv->conf->cache_size > 0) {
+        serv->cache = cache_init((size_t) serv->conf->cache_size * 1024,
+                                 (size_t) serv->conf->cache_max_file_size * 1024,
+                                 serv->conf->cache_revalidate);
+    }
+
+    // 8. 打开Web文件目录，之后请求的文件都相对于它打开，不会越过这个目录
+    serv->root_fd = open(serv->conf->doc_root[0] ? serv->conf->doc_root : "/",
+                         O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (serv->root_fd == -1) {
+        perror("open document root");
+        log_error(serv, "open document root %s: %s", serv->conf->doc_root, strerror(errno));
+        exit(1);
+    }
+
+    // 9. 读入错误页面，预先生成错误响应，之后出错时不再访问文件系统
+    http_response_load_errors(serv);
+
+    // 10. 创建共享的统计计数器，启动统计接口
+    metrics_init(serv);
+
+    // 11. 创建共享的连接计数，之后的工作进程和线程都按它决定是否接受连接
+    admission_init(serv);
+
     // 当有新的连接时创建客户端结构数据并fork()新的进程处理HTTP请求
     // 此处可以调用客户端管理模块的接口
 }
@@ -247,7 +251,7 @@ static void do_fork_strategy(server *serv){
 
     //循环接收
     while (1) {
-        if ((con = connection_accept(serv)) == NULL) {
+        if ((con = connection_accept(serv, 0)) == NULL) {
             continue;
         }
 
@@ -263,10 +267,48 @@ static void do_fork_strategy(server *serv){
         }
 
         printf("child process: %d\n", pid);
+        // 子进程关闭连接时减少连接计数
+        if (pid > 0)
+            con->admitted = 0;
         connection_close(con);
     }
 }
 
+// 对端关闭后继续写入不应终止整个服务进程
+static void ignore_sigpipe(){
+    struct sigaction sa;
+
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+}
+
+static void do_epoll_strategy(server *serv){
+    ignore_sigpipe();
+    log_async_start(serv);
+    event_loop(serv);
+}
+
+static void do_uring_strategy(server *serv){
+    ignore_sigpipe();
+    log_async_start(serv);
+    // 内核不支持io_uring时退回到epoll事件循环
+    if (uring_loop(serv) == -1)
+        event_loop(serv);
+}
+
+static void do_threads_strategy(server *serv){
+    ignore_sigpipe();
+    // 所有事件循环线程共用一个日志缓冲区和后台线程
+    log_async_start(serv);
+    reactor_run(serv);
+}
+
 // 主函数
 int main(int argc, char** argv) {
     
@@ -277,9 +319,13 @@ int main(int argc, char** argv) {
     int opt;
     
     serv = server_init();
+    serv->mode = -1;
+
+    // 根据CPU选择请求解析使用的向量指令
+    scan_init();
 
     // 解析命令行参数
-    while((opt = getopt(argc, argv, "p:l:r:d")) != -1) {
+    while((opt = getopt(argc, argv, "p:l:r:m:d")) != -1) {
         switch(opt) {
             // 设置端口号
             case 'p':
@@ -289,6 +335,14 @@ int main(int argc, char** argv) {
                     exit(1); 
                 }
                 break;
+            // 并发模型
+            case 'm':
+                serv->mode = config_parse_mode(optarg);
+                if (serv->mode == -1) {
+                    fprintf(stderr, "error: unknown mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
             // 在后台启动
             case 'd':
                 serv->is_daemon = 1;
@@ -313,7 +367,23 @@ int main(int argc, char** argv) {
     start_server(serv, "web.conf", chroot_path, logfile);
     
     // 进入主循环等待并处理客户端连接
-    do_fork_strategy(serv);
+    switch (serv->conf->mode) {
+        case SERVER_MODE_EPOLL:
+            do_epoll_strategy(serv);
+            break;
+        case SERVER_MODE_PREFORK:
+            prefork_run(serv);
+            break;
+        case SERVER_MODE_THREADS:
+            do_threads_strategy(serv);
+            break;
+        case SERVER_MODE_URING:
+            do_uring_strategy(serv);
+            break;
+        default:
+            do_fork_strategy(serv);
+            break;
+    }
     
     // 关闭日志文件
     log_close(serv);
@@ -6,9 +6,15 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "stringutils.h"
 #include "config.h"
+#include "cache.h"
+#include "timer.h"
+
+// 启动时预先生成的错误响应，定义在response.c中
+typedef struct error_page error_page;
 
 // 服务器结构体
 typedef struct {
@@ -24,6 +30,14 @@ typedef struct {
     int is_daemon;
     // 是否chroot
     int do_chroot;
+    // 命令行指定的并发模型，-1表示使用配置文件
+    int mode;
+    // 文件内容缓存，每个进程或线程各自拥有，NULL表示不使用
+    file_cache *cache;
+    // 预先生成的错误响应，所有进程和线程共享，只读
+    error_page *err_pages;
+    // Web文件目录，请求的文件都相对于它打开
+    int root_fd;
     // 配置信息
     config *conf;
 } server;
@@ -55,24 +69,81 @@ typedef struct {
     keyvalue *ptr;
     size_t len;
     size_t size;
+    // 不为NULL时键值字符串从该内存区分配，随内存区一起回收
+    arena *arena;
 } http_headers;
 
+// 接收缓冲区中的一段，用偏移表示，缓冲区扩容后仍然有效
+typedef struct {
+    size_t off;
+    size_t len;
+} http_slice;
+
+// 请求头部的名称和值在接收缓冲区中的位置
+typedef struct {
+    http_slice key;
+    http_slice value;
+} http_header_slice;
+
+// 一个请求最多包含的头部数，超过时按错误请求处理
+#define HTTP_REQUEST_HEADERS_MAX 64
+// 请求行和头部的总长度上限，超过时还没有收完头部则返回431并关闭连接
+#define HTTP_REQUEST_SIZE_MAX (16 * 1024)
+
 // HTTP请求结构体，包含HTTP方法，版本，URI，HTTP头，内容长度
 typedef struct {
     http_method method;
     http_version version;
+    // 请求行各部分和头部在recv_buf中的位置，接收时记录，不复制
+    http_slice method_slice;
+    http_slice uri_slice;
+    http_slice version_slice;
+    http_header_slice headers[HTTP_REQUEST_HEADERS_MAX];
+    size_t nheaders;
+    // 解析后指向recv_buf中以'\0'结尾的各部分，在下一个请求之前有效
+    const char *buf;
     char *method_raw;
     char *version_raw;
     char *uri;
-    http_headers *headers;
     int content_length;
 } http_request;
 
+// 一个请求最多处理的字节范围数，超过时忽略Range头部发送整个文件
+#define HTTP_RANGES_MAX 16
+
+// 文件内容中要发送的一段
+typedef struct {
+    // 在文件中的偏移和长度
+    off_t off;
+    off_t len;
+    // 多段响应中该段之前的分段头部在send_buf中的结束位置
+    size_t head_end;
+} http_range;
+
 // HTTP响应结构体，包含内容长度，内容，HTTP头部
 typedef struct {
-    int content_length;
+    off_t content_length;
     string *entity_body;
     http_headers *headers;
+    // 通过sendfile()直接发送的文件，-1表示没有
+    int body_fd;
+    // 文件中下一个要发送的位置
+    off_t body_off;
+    // 文件中剩余要发送的字节数
+    off_t body_left;
+    // 从缓存发送时指向缓存中的文件内容，此时不使用body_fd
+    const char *body_mem;
+    // 响应引用的缓存项，响应释放时释放引用
+    cache_entry *cached;
+    // 文件的修改时间和inode，用于If-Range和分段边界
+    time_t mtime;
+    ino_t ino;
+    // 文件的验证器，ETag和Last-Modified头部的值
+    char etag[CACHE_ETAG_SIZE];
+    char last_modified[CACHE_DATE_SIZE];
+    // 多段响应(multipart/byteranges)中各段的范围，单段响应只使用body_off和body_left
+    http_range ranges[HTTP_RANGES_MAX];
+    int nranges;
 } http_response;
 
 //接收状态
@@ -83,11 +154,54 @@ typedef enum {
     HTTP_RECV_STATE_SP1,
     HTTP_RECV_STATE_SP2,
     HTTP_RECV_STATE_LF,
-    HTTP_RECV_STATE_LINE
+    // 头部名称、冒号后的空白和头部的值
+    HTTP_RECV_STATE_KEY,
+    HTTP_RECV_STATE_SP3,
+    HTTP_RECV_STATE_VALUE,
+    // 请求已经完整接收
+    HTTP_RECV_STATE_DONE,
+    // 请求格式错误
+    HTTP_RECV_STATE_ERROR
 } http_recv_state;
 
-// 客户端连接结构体
+// 连接处理状态，用于非阻塞模式下在多次就绪事件之间保存进度
+typedef enum {
+    // 正在接收请求
+    CON_STATE_READ,
+    // 正在发送响应
+    CON_STATE_WRITE,
+    // 处理完毕，可以关闭
+    CON_STATE_CLOSE
+} connection_state;
+
+// 发送队列中的数据块类型
+typedef enum {
+    // 发送缓冲区send_buf中的一段，保存偏移以免缓冲区扩容后失效
+    SEND_CHUNK_BUF,
+    // 缓存中的文件内容
+    SEND_CHUNK_MEM,
+    // 通过sendfile()发送的文件
+    SEND_CHUNK_FILE
+} send_chunk_type;
+
+// 发送队列中的数据块，流水线上多个请求的响应依次排队后合并发送
 typedef struct {
+    send_chunk_type type;
+    // 缓存中的文件内容及其引用
+    const char *mem;
+    cache_entry *cached;
+    // 要发送的文件，发送完后关闭
+    int fd;
+    // 下一个要发送的位置：send_buf中的偏移、mem中的偏移或文件偏移
+    off_t off;
+    // 剩余的字节数
+    off_t left;
+    // 与同一响应后面的数据块共用文件描述符或缓存引用，释放时不关闭
+    int shared;
+} send_chunk;
+
+// 客户端连接结构体
+typedef struct connection {
     // 客户端连接的socket
     int sockfd;
     // 状态码
@@ -100,12 +214,44 @@ typedef struct {
     http_response *response;
     // 接收状态
     http_recv_state recv_state;
+    // 连接处理状态
+    connection_state state;
+    // 发送缓冲区，保存响应头部和出错页面
+    string *send_buf;
+    // 发送队列
+    send_chunk *chunks;
+    size_t nchunks;
+    size_t chunks_size;
+    // 第一个没有发送完的数据块
+    size_t chunk_pos;
     // 客户端地址信息
     struct sockaddr_in addr;
     // 请求长度
     size_t request_len;
-    // 请求文件的真实路径
+    // 请求文件的路径，由Web文件目录和规范化后的URI组成，也是缓存的键
     char real_path[PATH_MAX];
+    // 指向real_path中相对于Web文件目录的部分
+    char *rel_path;
+    // 当前响应发送完后是否保持连接
+    int keep_alive;
+    // 该连接上已处理的请求数
+    int requests;
+    // 发送队列中还没有发送完的响应数，以及第一个响应的请求开始处理的时间（微秒），用于统计延迟
+    int pending;
+    long long pending_since;
+    // 请求处理过程中的临时内存，每个请求结束后整体回收
+    arena *arena;
+    // 开始等待下一个请求的时间（建立连接或上一批响应发送完），以及当前请求收到第一个字节的时间，0表示还没有收到
+    time_t idle_since;
+    time_t request_start;
+    // 已经发送的字节数，以及当前发送检查周期开始的时间和当时已发送的字节数，用于检查最低发送速率
+    unsigned long long bytes_sent;
+    time_t send_since;
+    unsigned long long send_mark;
+    // 事件循环中的超时定时器
+    timer_node timer;
+    // 是否计入了准入控制的连接数，关闭时减少计数
+    int admitted;
 } connection;
 
 #endif
\ No newline at end of file
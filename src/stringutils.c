@@ -11,6 +11,7 @@ string* string_init() {
     s = malloc(sizeof(*s));
     s->ptr = NULL;
     s->size = s->len = 0;
+    s->arena = NULL;
     return s;
 }
 
@@ -21,9 +22,28 @@ string* string_init_str(const char *str) {
     return s;
 }
 
+string* string_init_arena(arena *a) {
+    string *s;
+    //字符串结构和存储区域都从内存区分配
+    s = arena_alloc(a, sizeof(*s));
+    s->ptr = NULL;
+    s->size = s->len = 0;
+    s->arena = a;
+    return s;
+}
+
+string* string_init_str_arena(arena *a, const char *str) {
+    string *s = string_init_arena(a);
+    string_copy(s, str);
+
+    return s;
+}
+
 void string_free(string *s) {
     //字符串为空直接返回
     if (!s) return;
+    //从内存区分配的字符串在内存区重置时回收
+    if (s->arena) return;
     free(s->ptr);
     free(s);
 }
@@ -38,15 +58,35 @@ void string_reset(string *s) {
     s->len = 0;
 }
 
+void string_consume(string *s, size_t n) {
+    //确定字符串不为空
+    assert(s != NULL);
+
+    if (n >= s->len) {
+        string_reset(s);
+        return;
+    }
+
+    memmove(s->ptr, s->ptr + n, s->len - n);
+    s->len -= n;
+    s->ptr[s->len] = '\0';
+}
+
 void string_extend(string *s, size_t new_len) {
     //确定字符串不为空
     assert(s != NULL);
 
     //新长度大于原本长度，则申请空间
     if (new_len >= s->size) {
+        size_t old_size = s->size;
+
         s->size += new_len - s->size;
         s->size += STRING_SIZE_INC - (s->size % STRING_SIZE_INC);
-        s->ptr = realloc(s->ptr, s->size);
+
+        if (s->arena)
+            s->ptr = arena_realloc(s->arena, s->ptr, old_size, s->size);
+        else
+            s->ptr = realloc(s->ptr, s->size);
     }
 }
 
@@ -59,7 +99,7 @@ int string_copy_len(string *s, const char *str, size_t str_len) {
     //为s申请空间
     string_extend(s, str_len + 1);
     //将str拷贝到s
-    strncpy(s->ptr, str, str_len);
+    memcpy(s->ptr, str, str_len);
     s->len = str_len;
     //添加终止符
     s->ptr[s->len] = '\0';
@@ -80,6 +120,10 @@ int string_append_string(string *s, string *s2) {
 }
 
 int string_append_int(string *s, int i) {
+    return string_append_long(s, i);
+}
+
+int string_append_long(string *s, long long i) {
     //确定s不为空
     assert(s != NULL);
     char buf[30];
@@ -88,20 +132,22 @@ int string_append_int(string *s, int i) {
     int len = 0;
     //符号标记
     int minus = 0;
+    //使用无符号数避免最小负数取反溢出
+    unsigned long long n = i;
     
     //将负数变正
     if (i < 0) {
         minus = 1;
-        i *= -1;
+        n = -n;
     } else if (i == 0) {
         string_append_ch(s, '0');
         return 1;
     }
     
     //整数大于9处理
-    while (i) {
-        buf[len++] = digits[i % 10];
-        i = i / 10;
+    while (n) {
+        buf[len++] = digits[n % 10];
+        n = n / 10;
     }
 
     if (minus)
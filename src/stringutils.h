@@ -3,6 +3,8 @@
 
 #include <stdlib.h>
 
+#include "arena.h"
+
 // 定义C语言的字符串
 typedef struct {
     // 实际存储区域
@@ -11,6 +13,8 @@ typedef struct {
     size_t size;
     // 字符串长度
     size_t len;
+    // 从内存区分配时指向内存区，此时不需要单独释放
+    arena *arena;
 }string;
 
 // 初始化字符串
@@ -18,12 +22,19 @@ string* string_init();
 // 使用char数组转化为字符串
 string* string_init_str(const char *str);
 
-// 释放字符串分配的内存
+// 初始化从内存区a分配的字符串，内存区重置后失效
+string* string_init_arena(arena *a);
+string* string_init_str_arena(arena *a, const char *str);
+
+// 释放字符串分配的内存，从内存区分配的字符串随内存区一起回收
 void string_free(string *s);
 
 // 重置字符串，将字符串清空，第一个字符设置为'\0'
 void string_reset(string *s);
 
+// 删除字符串开头的n个字符，剩余部分移动到开头
+void string_consume(string *s, size_t n);
+
 // 扩展字符串长度到new_len
 void string_extend(string *s, size_t new_len);
 
@@ -39,6 +50,9 @@ int string_append_string(string *s, string *s2);
 // 添加数字i到字符串末尾
 int string_append_int(string *s, int i);
 
+// 添加长整数i到字符串末尾
+int string_append_long(string *s, long long i);
+
 // 添加str到字符串s末尾，添加的长度为str_len
 int string_append_len(string *s, const char *str, size_t str_len);
 
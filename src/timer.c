@@ -0,0 +1,64 @@
+#include "timer.h"
+
+// 把定时器插入链表head的尾部
+static void list_add(timer_node *head, timer_node *t){
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timer_wheel_init(timer_wheel *w, time_t now) {
+    for (int i = 0; i < TIMER_SLOTS; i++)
+        w->slots[i].prev = w->slots[i].next = &w->slots[i];
+    w->now = now;
+}
+
+void timer_set(timer_wheel *w, timer_node *t, time_t expires) {
+    timer_cancel(t);
+
+    t->expires = expires;
+    if (expires < w->now)
+        expires = w->now;
+    list_add(&w->slots[expires & (TIMER_SLOTS - 1)], t);
+}
+
+void timer_cancel(timer_node *t) {
+    if (!t->next)
+        return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+void timer_wheel_advance(timer_wheel *w, time_t now, void (*expire)(timer_node *t, void *arg), void *arg) {
+    timer_node pending;
+    timer_node *slot;
+    timer_node *t;
+
+    // 跳过的时间超过一圈时每个槽位只需要检查一次
+    for (int n = 0; w->now <= now && n < TIMER_SLOTS; n++, w->now++) {
+        slot = &w->slots[w->now & (TIMER_SLOTS - 1)];
+        if (slot->next == slot)
+            continue;
+
+        // 先把整个槽位摘下，回调中重新设置的定时器不会在这一轮再次被检查
+        pending.next = slot->next;
+        pending.prev = slot->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        slot->prev = slot->next = slot;
+
+        while ((t = pending.next) != &pending) {
+            timer_cancel(t);
+            if (t->expires <= now)
+                expire(t, arg);
+            else
+                list_add(&w->slots[t->expires & (TIMER_SLOTS - 1)], t);
+        }
+    }
+
+    if (w->now <= now)
+        w->now = now + 1;
+}
@@ -0,0 +1,42 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <time.h>
+
+// 时间轮的槽位数（2的幂），每个槽位对应一秒，更远的截止时间在同一槽位中多转几圈
+#define TIMER_SLOTS 64
+
+// 一个定时器，嵌入在需要超时的对象中，不在时间轮中时next为NULL
+typedef struct timer_node {
+    struct timer_node *prev;
+    struct timer_node *next;
+    // 到期时间（秒）
+    time_t expires;
+} timer_node;
+
+// 按截止时间散列的时间轮：设置和取消都是O(1)，推进时只检查经过的槽位
+typedef struct {
+    // 每个槽位是一个带哨兵的循环链表
+    timer_node slots[TIMER_SLOTS];
+    // 下一个要检查的秒
+    time_t now;
+} timer_wheel;
+
+// 由定时器取得包含它的对象
+#define timer_entry(node, type, member) ((type *) ((char *) (node) - offsetof(type, member)))
+
+// 初始化时间轮，从now开始计时
+void timer_wheel_init(timer_wheel *w, time_t now);
+
+// 设置定时器在expires到期，已经设置时先取消；已经过去的时间在下一次推进时到期
+void timer_set(timer_wheel *w, timer_node *t, time_t expires);
+
+// 取消定时器，没有设置时什么也不做
+void timer_cancel(timer_node *t);
+
+// 推进到now，对每个到期的定时器调用expire()。调用前定时器已经取消，
+// expire()中可以重新设置它或释放包含它的对象
+void timer_wheel_advance(timer_wheel *w, time_t now, void (*expire)(timer_node *t, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,729 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "uring.h"
+#include "connection.h"
+#include "watcher.h"
+#include "metrics.h"
+#include "admission.h"
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#define SYS_io_uring_enter 426
+#define SYS_io_uring_register 427
+#endif
+
+// 提交队列的长度，完成队列是它的四倍，多次触发的recv可能一次产生很多完成事件
+#define URING_ENTRIES 1024
+// 提供给内核的接收缓冲区个数（2的幂）和每个的大小
+#define RECV_BUFS 256
+#define RECV_BUF_SIZE 4096
+#define RECV_BGID 0
+// 一次sendmsg()最多合并的数据块数
+#define SEND_IOV_MAX 64
+// 文件内容经过管道splice()到socket，希望的管道容量
+#define PIPE_SIZE (1 << 20)
+// 发送响应时接收队列中积压的数据超过这个长度就暂停接收，回到读状态后再继续
+#define RECV_BACKLOG_MAX (64 * 1024)
+
+// 完成事件的user_data低位记录操作类型，高位是连接结构的地址
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_WATCH,
+    OP_TICK,
+    OP_CANCEL
+};
+#define OP_MASK 7
+
+// 映射到用户空间的提交队列、完成队列和接收缓冲区
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // 已经填写、还没有提交的条目数
+    unsigned queued;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    // 注册给内核的接收缓冲区环，内核收到数据时从中取一个缓冲区
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *bufs;
+} uring;
+
+// io_uring后端中一个连接的状态
+typedef struct uring_conn {
+    connection *con;
+    // 已经提交、还没有最后一个完成事件的操作数，为0时才能释放连接
+    int inflight;
+    // 接收操作仍然有效，以及已经请求取消接收
+    int receiving;
+    int cancelling;
+    // 正在发送
+    int sending;
+    // 对端已关闭连接
+    int peer_closed;
+    // 正在关闭，等待进行中的操作结束
+    int closing;
+    // 发送文件内容的管道和其中还没有发送的字节数
+    int pipe[2];
+    size_t pipe_size;
+    size_t pipe_pending;
+    // 本次splice()是否从文件读出，还没有完成的个数和两个方向的结果
+    int splice_file;
+    int splice_left;
+    int splice_res[2];
+    // sendmsg()的参数在操作完成前必须保持有效
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr msg;
+    // 超时定时器
+    timer_node timer;
+} uring_conn;
+
+// 事件循环的状态
+typedef struct {
+    server *serv;
+    uring ring;
+    watcher *w;
+    // 内核不支持多次触发的accept或recv时退回到每次重新提交
+    int multishot_accept;
+    int multishot_recv;
+    // 每秒一次的超时，用于推进时间轮
+    struct __kernel_timespec tick;
+    time_t now;
+    timer_wheel timers;
+} uring_ctx;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 把接收缓冲区bid交还给内核
+static void recycle_buf(uring *r, unsigned short bid){
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (RECV_BUFS - 1)];
+
+    // 第一个条目的resv字段与tail重叠，只写地址、长度和编号
+    b->addr = (unsigned long) (r->bufs + (size_t) bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void ring_free(uring *r){
+    if (r->bufs)
+        munmap(r->bufs, (size_t) RECV_BUFS * RECV_BUF_SIZE);
+    if (r->br)
+        munmap(r->br, RECV_BUFS * sizeof(struct io_uring_buf));
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_size);
+    if (r->fd > -1)
+        close(r->fd);
+}
+
+// 创建io_uring并映射队列，注册接收缓冲区环，失败时返回-1并设置errno
+static int ring_init(uring *r){
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *base;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    // 只由事件循环线程提交，完成事件在进入内核等待时才处理
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+
+    // 较旧的内核不支持这些标志
+    if (r->fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (r->fd == -1)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size)
+            r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    base = r->sq_ptr;
+    r->sq_head = (unsigned *) (base + p.sq_off.head);
+    r->sq_tail = (unsigned *) (base + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (base + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (base + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+
+    base = r->cq_ptr;
+    r->cq_head = (unsigned *) (base + p.cq_off.head);
+    r->cq_tail = (unsigned *) (base + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+
+    // 接收缓冲区环必须按页对齐
+    r->br = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->bufs = mmap(NULL, (size_t) RECV_BUFS * RECV_BUF_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED || r->bufs == MAP_FAILED) {
+        if (r->br == MAP_FAILED)
+            r->br = NULL;
+        if (r->bufs == MAP_FAILED)
+            r->bufs = NULL;
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) r->br;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_BGID;
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        goto fail;
+
+    for (int i = 0; i < RECV_BUFS; i++)
+        recycle_buf(r, i);
+
+    return 0;
+
+fail:
+    err = errno;
+    ring_free(r);
+    errno = err;
+    return -1;
+}
+
+// 提交已经填写的条目，wait为1时同时等待至少一个完成事件
+static int ring_submit(uring *r, int wait){
+    int n;
+
+    do {
+        n = sys_io_uring_enter(r->fd, r->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n > 0)
+        r->queued -= n;
+
+    return n;
+}
+
+// 取一个空闲的提交条目，提交队列已满时先提交
+static struct io_uring_sqe* get_sqe(uring_ctx *ctx, int opcode, int fd, void *ptr, int op){
+    uring *r = &ctx->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (ring_submit(r, 0) == -1 && errno != EAGAIN && errno != EBUSY) {
+            log_error(ctx->serv, "io_uring_enter: %s", strerror(errno));
+            exit(1);
+        }
+    }
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t) ptr | op;
+
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+
+    return sqe;
+}
+
+// 按连接当前的阶段重新设置超时定时器
+static void update_timer(uring_ctx *ctx, uring_conn *uc){
+    time_t deadline = connection_deadline(ctx->serv, uc->con);
+
+    if (deadline)
+        timer_set(&ctx->timers, &uc->timer, deadline);
+    else
+        timer_cancel(&uc->timer);
+}
+
+static void arm_accept(uring_ctx *ctx){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_ACCEPT, ctx->serv->sockfd, NULL, OP_ACCEPT);
+
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (ctx->multishot_accept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void arm_tick(uring_ctx *ctx){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_TIMEOUT, -1, NULL, OP_TICK);
+
+    sqe->addr = (uintptr_t) &ctx->tick;
+    sqe->len = 1;
+}
+
+static void arm_watch(uring_ctx *ctx){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_POLL_ADD, watcher_fd(ctx->w), NULL, OP_WATCH);
+
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+}
+
+// 接收时由内核从缓冲区环中选择缓冲区，多次触发时一次提交持续接收
+static void arm_recv(uring_ctx *ctx, uring_conn *uc){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_RECV, uc->con->sockfd, uc, OP_RECV);
+
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BGID;
+    if (ctx->multishot_recv)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    uc->receiving = 1;
+    uc->inflight++;
+}
+
+// 取消多次触发的接收，接收操作以-ECANCELED结束
+static void cancel_recv(uring_ctx *ctx, uring_conn *uc){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCEL);
+
+    sqe->addr = (uintptr_t) uc | OP_RECV;
+    uc->cancelling = 1;
+}
+
+static void arm_splice(uring_ctx *ctx, uring_conn *uc, int op, int fd_in, off_t off_in, int fd_out, size_t len, int link){
+    struct io_uring_sqe *sqe = get_sqe(ctx, IORING_OP_SPLICE, fd_out, uc, op);
+
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = off_in < 0 ? (uint64_t) -1 : (uint64_t) off_in;
+    sqe->off = (uint64_t) -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    if (link)
+        sqe->flags = IOSQE_IO_LINK;
+
+    uc->inflight++;
+    uc->splice_left++;
+}
+
+// 关闭读写两端，进行中的接收和发送操作会很快结束，最后一个完成事件到达后释放连接
+static void start_close(uring_ctx *ctx, uring_conn *uc){
+    if (uc->closing)
+        return;
+
+    uc->closing = 1;
+    timer_cancel(&uc->timer);
+    shutdown(uc->con->sockfd, SHUT_RDWR);
+}
+
+// 没有进行中的操作时释放正在关闭的连接，返回1表示已释放
+static int finish_close(uring_conn *uc){
+    if (!uc->closing || uc->inflight > 0)
+        return 0;
+
+    if (uc->pipe[0] > -1) {
+        close(uc->pipe[0]);
+        close(uc->pipe[1]);
+    }
+    metrics_connection(0);
+    connection_close(uc->con);
+    free(uc);
+
+    return 1;
+}
+
+static int open_pipe(uring_conn *uc){
+    int size;
+
+    if (uc->pipe[0] > -1)
+        return 0;
+
+    if (pipe2(uc->pipe, O_CLOEXEC) == -1)
+        return -1;
+
+    // 管道越大，一对splice()能发送的文件内容越多，超过系统上限时保持默认大小
+    fcntl(uc->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    size = fcntl(uc->pipe[1], F_GETPIPE_SZ);
+    uc->pipe_size = size > 0 ? size : 65536;
+
+    return 0;
+}
+
+static void handle_state(uring_ctx *ctx, uring_conn *uc, connection_state state);
+
+// 发送队列中的下一段数据：连续的内存数据块合并为一次sendmsg()，
+// 文件内容由一对链接的splice()经过管道送到socket，不经过用户态
+static void send_next(uring_ctx *ctx, uring_conn *uc){
+    connection *con = uc->con;
+    struct io_uring_sqe *sqe;
+    send_chunk *c;
+    size_t len;
+    int more;
+
+    // 管道中还有上次读出的文件内容，先把它发送完
+    if (uc->pipe_pending > 0) {
+        uc->sending = 1;
+        uc->splice_file = 0;
+        uc->splice_res[0] = 0;
+        arm_splice(ctx, uc, OP_SPLICE_OUT, uc->pipe[0], -1, con->sockfd, uc->pipe_pending, 0);
+        return;
+    }
+
+    if ((c = connection_send_chunk(con)) == NULL) {
+        uc->sending = 0;
+        handle_state(ctx, uc, connection_sent(ctx->serv, con, uc->peer_closed));
+        return;
+    }
+
+    uc->sending = 1;
+
+    if (c->type == SEND_CHUNK_FILE) {
+        if (open_pipe(uc) == -1) {
+            log_error(ctx->serv, "pipe: %s", strerror(errno));
+            start_close(ctx, uc);
+            return;
+        }
+
+        len = c->left < (off_t) uc->pipe_size ? (size_t) c->left : uc->pipe_size;
+        uc->splice_file = 1;
+        arm_splice(ctx, uc, OP_SPLICE_IN, c->fd, c->off, uc->pipe[1], len, 1);
+        arm_splice(ctx, uc, OP_SPLICE_OUT, uc->pipe[0], -1, con->sockfd, len, 0);
+        return;
+    }
+
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = connection_send_iov(con, uc->iov, SEND_IOV_MAX, &more);
+
+    sqe = get_sqe(ctx, IORING_OP_SENDMSG, con->sockfd, uc, OP_SEND);
+    sqe->addr = (uintptr_t) &uc->msg;
+    // 后面紧接着文件内容时让内核暂缓发送，头部和文件开头可以合并在同一个报文段中
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    uc->inflight++;
+}
+
+// 多次触发的接收在发送响应时也会继续，客户端不读取响应却一直发送时接收队列会无限增长。
+// 积压超过上限时取消接收，回到读状态后重新提交
+static void update_recv(uring_ctx *ctx, uring_conn *uc){
+    connection *con = uc->con;
+    int paused = con->state != CON_STATE_READ && con->recv_buf->len >= RECV_BACKLOG_MAX;
+
+    if (uc->closing || uc->peer_closed)
+        return;
+
+    if (!uc->receiving && !paused)
+        arm_recv(ctx, uc);
+    else if (uc->receiving && paused && !uc->cancelling)
+        cancel_recv(ctx, uc);
+}
+
+// 根据处理后的连接状态继续发送或关闭
+static void handle_state(uring_ctx *ctx, uring_conn *uc, connection_state state){
+    if (state == CON_STATE_CLOSE)
+        start_close(ctx, uc);
+    else if (state == CON_STATE_WRITE && !uc->sending)
+        send_next(ctx, uc);
+
+    update_recv(ctx, uc);
+}
+
+static void on_accept(uring_ctx *ctx, struct io_uring_cqe *cqe){
+    uring_conn *uc;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if (cqe->res >= 0) {
+        // 多次触发的accept不返回客户端地址
+        if (getpeername(cqe->res, (struct sockaddr *) &addr, &addr_len) == -1)
+            memset(&addr, 0, sizeof(addr));
+
+        if (admission_admit(ctx->serv, cqe->res, &addr)) {
+            uc = calloc(1, sizeof(*uc));
+            uc->con = connection_new(cqe->res, &addr);
+            uc->con->admitted = 1;
+            uc->pipe[0] = uc->pipe[1] = -1;
+
+            metrics_connection(1);
+            update_timer(ctx, uc);
+            arm_recv(ctx, uc);
+        }
+    } else if (cqe->res == -EINVAL && ctx->multishot_accept) {
+        log_info(ctx->serv, "io_uring: multishot accept not supported");
+        ctx->multishot_accept = 0;
+    } else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+        log_error(ctx->serv, "accept: %s", strerror(-cqe->res));
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_accept(ctx);
+}
+
+static void on_recv(uring_ctx *ctx, uring_conn *uc, struct io_uring_cqe *cqe){
+    connection *con = uc->con;
+    connection_state state = con->state;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (cqe->res > 0) {
+        // 数据复制到接收队列后立即归还缓冲区，解析需要连续的数据
+        state = connection_received(ctx->serv, con, ctx->ring.bufs + (size_t) bid * RECV_BUF_SIZE,
+                                    cqe->res, 0);
+        recycle_buf(&ctx->ring, bid);
+    } else if (cqe->res == 0) {
+        //对端关闭连接，已经收到的完整请求仍然需要响应
+        log_info(ctx->serv, "socket %d closed", con->sockfd);
+        uc->peer_closed = 1;
+        state = connection_received(ctx->serv, con, NULL, 0, 1);
+    } else if (cqe->res == -EINVAL && ctx->multishot_recv) {
+        log_info(ctx->serv, "io_uring: multishot recv not supported");
+        ctx->multishot_recv = 0;
+    } else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        log_error(ctx->serv, "read: %s", strerror(-cqe->res));
+        state = CON_STATE_CLOSE;
+    }
+
+    // 多次触发的接收在出错、缓冲区用完或被取消时结束，由handle_state()按需重新提交
+    update_timer(ctx, uc);
+    handle_state(ctx, uc, state);
+}
+
+static void on_send(uring_ctx *ctx, uring_conn *uc, struct io_uring_cqe *cqe){
+    if (cqe->res <= 0) {
+        log_error(ctx->serv, "send: %s", cqe->res ? strerror(-cqe->res) : "no progress");
+        start_close(ctx, uc);
+        return;
+    }
+
+    metrics_sent(cqe->res);
+    connection_advance(uc->con, cqe->res);
+    update_timer(ctx, uc);
+    send_next(ctx, uc);
+}
+
+// 一对splice()都完成后再处理：读出的字节已从发送队列中移除，留在管道中的部分下次先发送
+static void on_splice(uring_ctx *ctx, uring_conn *uc, int op, struct io_uring_cqe *cqe){
+    int in, out;
+
+    uc->splice_res[op == OP_SPLICE_OUT] = cqe->res;
+    if (--uc->splice_left > 0)
+        return;
+
+    in = uc->splice_res[0];
+    out = uc->splice_res[1];
+
+    if (in > 0) {
+        uc->pipe_pending += in;
+        connection_advance(uc->con, in);
+    }
+    if (out > 0) {
+        uc->pipe_pending -= out;
+        metrics_sent(out);
+    }
+
+    // 读文件出错或文件在发送过程中被截断
+    if (uc->splice_file && in <= 0) {
+        log_error(ctx->serv, "splice: %s", in ? strerror(-in) : "file truncated");
+        start_close(ctx, uc);
+        return;
+    }
+
+    // 读出的内容比请求的少时链接中的第二个操作被取消，其余错误都是socket出错
+    if (out < 0 && out != -ECANCELED) {
+        log_error(ctx->serv, "send: %s", strerror(-out));
+        start_close(ctx, uc);
+        return;
+    }
+
+    update_timer(ctx, uc);
+    send_next(ctx, uc);
+}
+
+// 定时器到期，超时的连接开始关闭，发送速率足够的连接进入下一个检查周期
+static void expire_connection(timer_node *t, void *arg){
+    uring_ctx *ctx = arg;
+    uring_conn *uc = timer_entry(t, uring_conn, timer);
+
+    if (connection_timed_out(ctx->serv, uc->con, ctx->now)) {
+        start_close(ctx, uc);
+        finish_close(uc);
+    } else {
+        update_timer(ctx, uc);
+    }
+}
+
+static void handle_cqe(uring_ctx *ctx, struct io_uring_cqe *cqe){
+    uring_conn *uc = (uring_conn *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+
+    switch (op) {
+        case OP_ACCEPT:
+            on_accept(ctx, cqe);
+            return;
+        case OP_TICK:
+            timer_wheel_advance(&ctx->timers, ctx->now, expire_connection, ctx);
+            arm_tick(ctx);
+            return;
+        case OP_WATCH:
+            watcher_process(ctx->w);
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                arm_watch(ctx);
+            return;
+        case OP_CANCEL:
+            return;
+    }
+
+    // 多次触发的操作在最后一个完成事件之前一直有效
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uc->inflight--;
+        if (op == OP_RECV)
+            uc->receiving = uc->cancelling = 0;
+    }
+
+    if (uc->closing) {
+        if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER))
+            recycle_buf(&ctx->ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        finish_close(uc);
+        return;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            on_recv(ctx, uc, cqe);
+            break;
+        case OP_SEND:
+            on_send(ctx, uc, cqe);
+            break;
+        case OP_SPLICE_IN:
+        case OP_SPLICE_OUT:
+            on_splice(ctx, uc, op, cqe);
+            break;
+    }
+
+    finish_close(uc);
+}
+
+int uring_loop(server *serv) {
+    uring_ctx ctx;
+    uring *r = &ctx.ring;
+    unsigned head, tail;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.serv = serv;
+    ctx.multishot_accept = ctx.multishot_recv = 1;
+    ctx.tick.tv_sec = 1;
+
+    if (ring_init(r) == -1) {
+        log_error(serv, "io_uring: %s, falling back to epoll", strerror(errno));
+        return -1;
+    }
+
+    ctx.now = time(NULL);
+    timer_wheel_init(&ctx.timers, ctx.now);
+    arm_accept(&ctx);
+    arm_tick(&ctx);
+
+    // 缓存属于当前事件循环，监视器也由它创建并在同一线程中处理
+    if ((ctx.w = watcher_init(serv)) != NULL)
+        arm_watch(&ctx);
+
+    while (1) {
+        // 一次系统调用提交上一轮处理中产生的所有操作并等待完成事件
+        if (ring_submit(r, 1) == -1 && errno != EAGAIN && errno != EBUSY) {
+            log_error(serv, "io_uring_enter: %s", strerror(errno));
+            break;
+        }
+
+        ctx.now = time(NULL);
+        admission_batch_begin();
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            handle_cqe(&ctx, &r->cqes[head & *r->cq_mask]);
+            head++;
+            // 完成事件处理完后再归还，处理过程中内核可能已经追加了新的事件
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            if (head == tail)
+                tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        admission_batch_end(serv);
+    }
+
+    watcher_free(ctx.w);
+    ring_free(r);
+
+    return 0;
+}
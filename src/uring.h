@@ -0,0 +1,10 @@
+#ifndef URING_H
+#define URING_H
+
+#include "server.h"
+
+// 运行io_uring事件循环，在一个进程中处理所有连接：多次触发的accept和recv、
+// 由内核选择的接收缓冲区、批量提交。内核不支持时返回-1，由调用者改用epoll
+int uring_loop(server *serv);
+
+#endif
@@ -0,0 +1,205 @@
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "watcher.h"
+
+// 需要关注的事件：文件内容、属性、创建、删除和移动
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// 监视描述符与目录路径的对应关系
+typedef struct {
+    int wd;
+    char *path;
+} watch_dir;
+
+struct watcher {
+    server *serv;
+    // inotify文件描述符
+    int fd;
+    // 所有被监视的目录
+    watch_dir *dirs;
+    size_t len;
+    size_t size;
+    // 有目录没能监视时为1，此时缓存退回到按时间stat()确认
+    int degraded;
+};
+
+// 监视不完整时不能再信任缓存，恢复配置的确认间隔
+static void degrade(watcher *w, const char *path){
+    if (w->degraded)
+        return;
+
+    w->degraded = 1;
+    w->serv->cache->revalidate = w->serv->conf->cache_revalidate;
+    log_error(w->serv, "inotify_add_watch %s: %s, falling back to stat() revalidation",
+              path, strerror(errno));
+}
+
+static const char* find_dir(watcher *w, int wd){
+    for (size_t i = 0; i < w->len; i++) {
+        if (w->dirs[i].wd == wd)
+            return w->dirs[i].path;
+    }
+    return NULL;
+}
+
+static void forget_dir(watcher *w, int wd){
+    for (size_t i = 0; i < w->len; i++) {
+        if (w->dirs[i].wd == wd) {
+            free(w->dirs[i].path);
+            w->dirs[i] = w->dirs[--w->len];
+            return;
+        }
+    }
+}
+
+// 监视目录path及其所有子目录
+static void add_tree(watcher *w, const char *path){
+    char child[PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    int wd;
+
+    wd = inotify_add_watch(w->fd, path, WATCH_MASK);
+    if (wd == -1) {
+        degrade(w, path);
+        return;
+    }
+
+    // 同一目录重复添加时inotify返回相同的监视描述符
+    if (!find_dir(w, wd)) {
+        if (w->len >= w->size) {
+            w->size = w->size ? w->size * 2 : 16;
+            w->dirs = realloc(w->dirs, w->size * sizeof(*w->dirs));
+        }
+        w->dirs[w->len].wd = wd;
+        w->dirs[w->len].path = strdup(path);
+        w->len++;
+    }
+
+    if (!(dir = opendir(path)))
+        return;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        if (snprintf(child, sizeof(child), "%s/%s", path, ent->d_name) >= sizeof(child))
+            continue;
+
+        // 符号链接的目标如果在Web目录内，会作为真实路径被单独监视
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+            add_tree(w, child);
+    }
+
+    closedir(dir);
+}
+
+watcher* watcher_init(server *serv) {
+    watcher *w;
+
+    if (!serv->cache || !serv->conf->cache_watch)
+        return NULL;
+
+    w = malloc(sizeof(*w));
+    memset(w, 0, sizeof(*w));
+    w->serv = serv;
+
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd == -1) {
+        log_error(serv, "inotify_init1: %s", strerror(errno));
+        free(w);
+        return NULL;
+    }
+
+    add_tree(w, serv->conf->doc_root);
+
+    // 所有目录都被监视时，文件改变一定会产生事件，缓存不再需要stat()确认
+    if (!w->degraded)
+        serv->cache->revalidate = -1;
+
+    return w;
+}
+
+void watcher_free(watcher *w) {
+    if (!w) return;
+
+    for (size_t i = 0; i < w->len; i++)
+        free(w->dirs[i].path);
+    free(w->dirs);
+    close(w->fd);
+    free(w);
+}
+
+int watcher_fd(watcher *w) {
+    return w->fd;
+}
+
+static void handle_event(watcher *w, struct inotify_event *ev){
+    file_cache *cache = w->serv->cache;
+    char path[PATH_MAX];
+    const char *dir;
+
+    // 事件队列溢出，可能丢失了事件，只能清空缓存
+    if (ev->mask & IN_Q_OVERFLOW) {
+        log_error(w->serv, "inotify queue overflow, clearing cache");
+        cache_clear(cache);
+        return;
+    }
+
+    if (!(dir = find_dir(w, ev->wd)))
+        return;
+
+    // 被监视的目录本身被删除或移走
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        cache_invalidate_dir(cache, dir);
+        if (ev->mask & IN_IGNORED)
+            forget_dir(w, ev->wd);
+        return;
+    }
+
+    if (ev->len == 0)
+        return;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, ev->name) >= sizeof(path))
+        return;
+
+    cache_invalidate(cache, path);
+
+    if (ev->mask & IN_ISDIR) {
+        // 子目录被移走或删除时，其中的缓存项全部失效
+        if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+            cache_invalidate_dir(cache, path);
+        // 新建或移入的子目录需要继续监视
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+            add_tree(w, path);
+    }
+}
+
+void watcher_process(watcher *w) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+
+    while (1) {
+        len = read(w->fd, buf, sizeof(buf));
+
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return;
+
+        for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            handle_event(w, ev);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "server.h"
+
+// 用inotify监视Web文件目录，文件改变时使对应的缓存项失效
+typedef struct watcher watcher;
+
+// 递归监视serv->conf->doc_root，全部目录都监视成功时缓存项不再需要stat()确认；
+// 没有缓存、禁用监视或inotify不可用时返回NULL
+watcher* watcher_init(server *serv);
+
+// 释放监视器
+void watcher_free(watcher *w);
+
+// inotify文件描述符，可读时调用watcher_process()
+int watcher_fd(watcher *w);
+
+// 处理所有等待的inotify事件
+void watcher_process(watcher *w);
+
+#endif
@@ -0,0 +1,717 @@
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// HTTP负载生成器：多个线程各自用epoll驱动一组连接，支持持久连接、流水线和按固定速率发送，
+// 报告吞吐量以及经过coordinated omission修正的延迟分位数，可以重放访问日志中的URI
+// 用法见usage()
+
+// 每个连接最多同时等待的流水线请求数
+#define PIPELINE_MAX 64
+// 响应头部的最大长度
+#define HEAD_MAX 16384
+// 延迟直方图：小于128微秒时每个值一个桶，之后每个2的幂区间分成64个桶，误差小于1.6%
+#define HIST_SUB 64
+#define HIST_BUCKETS (2 * HIST_SUB + 40 * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram;
+
+// 等待响应的请求
+typedef struct {
+    // 计划发送的时间和实际发送的时间（微秒）
+    uint64_t intended;
+    uint64_t sent;
+    // 请求在URI列表中的序号，连接被关闭时重新发送
+    size_t uri;
+} pending_req;
+
+typedef enum {
+    RESP_HEAD,
+    RESP_BODY
+} resp_state;
+
+typedef struct {
+    int fd;
+    int connecting;
+    // 发送缓冲区和已经发送的位置
+    char *wbuf;
+    size_t wlen;
+    size_t wsize;
+    size_t woff;
+    // 已发送或在发送缓冲区中、还没有收到响应的请求，按顺序排列
+    pending_req pending[PIPELINE_MAX];
+    int npending;
+    int nsent;
+    // 按固定速率发送时下一个请求的计划时间
+    uint64_t next_send;
+    // 正在接收的响应
+    resp_state state;
+    char head[HEAD_MAX];
+    size_t head_len;
+    long long body_left;
+    int status;
+    int close_after;
+} bench_conn;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int epfd;
+    bench_conn *conns;
+    int nconns;
+    histogram service;
+    histogram latency;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[6];
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t reconnects;
+} worker;
+
+// 命令行参数
+static struct sockaddr_in target;
+static char host_header[300];
+static int nthreads = 2;
+static int nconns = 64;
+static int duration = 10;
+static int depth = 1;
+static int keepalive = 1;
+static double rate = 0;
+
+// 要请求的URI，来自-u或访问日志
+static char **uris;
+static size_t nuris;
+static size_t uris_size;
+// 所有线程共享的下一个URI序号
+static size_t next_uri;
+
+static uint64_t start_us;
+static uint64_t end_us;
+
+static uint64_t now_us(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v){
+    int e, shift;
+
+    if (v < 2 * HIST_SUB)
+        return v;
+
+    e = 63 - __builtin_clzll(v);
+    shift = e - 6;
+    if (shift > 39)
+        return HIST_BUCKETS - 1;
+    return 2 * HIST_SUB + (shift - 1) * HIST_SUB + (int) (v >> shift) - HIST_SUB;
+}
+
+// 桶中的最大值，报告分位数时使用
+static uint64_t hist_value(int i){
+    int shift;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+
+    shift = (i - 2 * HIST_SUB) / HIST_SUB + 1;
+    return ((uint64_t) ((i - 2 * HIST_SUB) % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(histogram *h, uint64_t v, uint64_t count){
+    h->counts[hist_index(v)] += count;
+    h->total += count;
+    h->sum += (double) v * count;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(histogram *to, const histogram *from){
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+static uint64_t hist_percentile(const histogram *h, double p){
+    uint64_t want = (uint64_t) (h->total * p / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (want == 0)
+        want = 1;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// 按HdrHistogram的方法修正coordinated omission：超过预期间隔的延迟说明这期间
+// 本应发出的请求都被阻塞了，补上这些请求应有的延迟
+static void hist_correct(histogram *to, const histogram *from, uint64_t interval){
+    uint64_t v;
+
+    memset(to, 0, sizeof(*to));
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (from->counts[i] == 0)
+            continue;
+
+        v = hist_value(i) < from->max ? hist_value(i) : from->max;
+        hist_add(to, v, from->counts[i]);
+
+        if (interval == 0)
+            continue;
+        for (uint64_t missed = v > interval ? v - interval : 0; missed >= interval; missed -= interval)
+            hist_add(to, missed, from->counts[i]);
+    }
+}
+
+static void add_uri(const char *uri, size_t len){
+    if (nuris == uris_size) {
+        uris_size = uris_size ? uris_size * 2 : 64;
+        uris = realloc(uris, uris_size * sizeof(*uris));
+    }
+    uris[nuris] = strndup(uri, len);
+    nuris++;
+}
+
+// 读入log_request()写的访问日志，取出其中GET请求的URI
+static void load_access_log(const char *path){
+    char line[8192];
+    char *p, *uri, *end;
+    size_t skipped = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+
+    // 格式为：IP - - [日期] "方法 URI 版本" 状态码 长度
+    while (fgets(line, sizeof(line), fp)) {
+        if (!(p = strchr(line, '"')) || strncmp(p + 1, "GET ", 4) != 0) {
+            skipped++;
+            continue;
+        }
+        uri = p + 5;
+        if (!(end = strchr(uri, '"'))) {
+            skipped++;
+            continue;
+        }
+        // URI之后是版本，HTTP/0.9请求没有版本
+        for (p = end; p > uri && p[-1] != ' '; p--);
+        if (p > uri && strncmp(p, "HTTP/", 5) == 0)
+            end = p - 1;
+        while (end > uri && end[-1] == ' ')
+            end--;
+        if (end == uri || *uri != '/') {
+            skipped++;
+            continue;
+        }
+        add_uri(uri, end - uri);
+    }
+
+    fclose(fp);
+    fprintf(stderr, "loaded %zu URIs from %s (%zu lines skipped)\n", nuris, path, skipped);
+}
+
+static void set_nodelay(int fd){
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void conn_open(worker *w, bench_conn *c){
+    struct epoll_event ev;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    set_nodelay(c->fd);
+
+    c->connecting = 1;
+    c->wlen = c->woff = 0;
+    c->nsent = 0;
+    c->state = RESP_HEAD;
+    c->head_len = 0;
+    c->close_after = 0;
+
+    if (connect(c->fd, (struct sockaddr *) &target, sizeof(target)) == -1 && errno != EINPROGRESS) {
+        w->connect_errors++;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+// 关闭连接并重新连接，没有收到响应的请求重新发送
+static void conn_reopen(worker *w, bench_conn *c){
+    close(c->fd);
+    w->reconnects++;
+
+    // 重新放入发送缓冲区时保留原来的计划时间
+    conn_open(w, c);
+}
+
+static void append_request(bench_conn *c, size_t uri){
+    const char *u = uris[uri];
+    size_t need = strlen(u) + strlen(host_header) + 96;
+    int n;
+
+    if (c->wlen + need > c->wsize) {
+        c->wsize = (c->wlen + need) * 2;
+        c->wbuf = realloc(c->wbuf, c->wsize);
+    }
+
+    n = snprintf(c->wbuf + c->wlen, c->wsize - c->wlen,
+                 "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: webbench\r\n%s\r\n",
+                 u, host_header, keepalive ? "" : "Connection: close\r\n");
+    c->wlen += n;
+}
+
+// 把待发送的请求写入发送缓冲区
+static void fill_requests(bench_conn *c, uint64_t now){
+    size_t uri;
+
+    // 重新连接后先补发之前没有收到响应的请求
+    while (c->nsent < c->npending) {
+        c->pending[c->nsent].sent = now;
+        append_request(c, c->pending[c->nsent].uri);
+        c->nsent++;
+    }
+
+    while (c->npending < depth && !(!keepalive && c->npending > 0)) {
+        if (rate > 0 && c->next_send > now)
+            break;
+
+        uri = __atomic_fetch_add(&next_uri, 1, __ATOMIC_RELAXED) % nuris;
+        c->pending[c->npending].intended = rate > 0 ? c->next_send : now;
+        c->pending[c->npending].sent = now;
+        c->pending[c->npending].uri = uri;
+        c->npending++;
+        c->nsent++;
+        append_request(c, uri);
+
+        if (rate > 0)
+            c->next_send += (uint64_t) (nconns * 1e6 / rate);
+    }
+}
+
+// 返回-1表示出错
+static int flush_writes(bench_conn *c){
+    ssize_t n;
+
+    while (c->woff < c->wlen) {
+        n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        c->woff += n;
+    }
+
+    c->wlen = c->woff = 0;
+    return 0;
+}
+
+static void response_done(worker *w, bench_conn *c, int status){
+    uint64_t now = now_us();
+    pending_req *r = &c->pending[0];
+
+    if (now < end_us) {
+        hist_add(&w->service, now - r->sent, 1);
+        hist_add(&w->latency, now - r->intended, 1);
+        w->requests++;
+        w->status[status / 100 < 6 ? status / 100 : 0]++;
+    }
+
+    memmove(c->pending, c->pending + 1, (c->npending - 1) * sizeof(*r));
+    c->npending--;
+    c->nsent--;
+}
+
+// 在响应头部中查找指定名称的头部，返回值的开始位置
+static const char* find_header(const char *head, const char *name){
+    size_t len = strlen(name);
+    const char *p = strstr(head, "\r\n");
+
+    while (p && p[2] != '\r') {
+        p += 2;
+        if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ')
+                p++;
+            return p;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+// 解析收到的数据，返回-1表示连接需要重新建立
+static int parse_responses(worker *w, bench_conn *c, const char *data, size_t len){
+    const char *end, *v;
+    size_t take;
+    int status;
+
+    while (len > 0) {
+        if (c->state == RESP_BODY) {
+            take = (long long) len < c->body_left ? len : c->body_left;
+            c->body_left -= take;
+            data += take;
+            len -= take;
+        } else {
+            take = HEAD_MAX - 1 - c->head_len;
+            if (take > len)
+                take = len;
+            memcpy(c->head + c->head_len, data, take);
+            c->head_len += take;
+            c->head[c->head_len] = '\0';
+
+            if (!(end = strstr(c->head, "\r\n\r\n"))) {
+                if (c->head_len >= HEAD_MAX - 1)
+                    return -1;
+                data += take;
+                len -= take;
+                continue;
+            }
+
+            // 头部之后已经属于响应体的数据退回给下一轮处理
+            take -= c->head_len - (end + 4 - c->head);
+            data += take;
+            len -= take;
+
+            if (c->npending == 0 || strncmp(c->head, "HTTP/1.", 7) != 0)
+                return -1;
+
+            status = atoi(c->head + 9);
+            v = find_header(c->head, "Content-Length");
+            c->body_left = v ? atoll(v) : 0;
+            v = find_header(c->head, "Connection");
+            c->close_after = v && strncasecmp(v, "close", 5) == 0;
+            if (status == 304 || status == 204)
+                c->body_left = 0;
+
+            c->state = RESP_BODY;
+            c->head_len = 0;
+            c->status = status;
+        }
+
+        if (c->state == RESP_BODY && c->body_left == 0) {
+            response_done(w, c, c->status);
+            c->state = RESP_HEAD;
+            if (c->close_after)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void handle_event(worker *w, bench_conn *c, uint32_t events){
+    char buf[65536];
+    ssize_t n;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (c->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            w->connect_errors++;
+            close(c->fd);
+            conn_open(w, c);
+            return;
+        }
+        c->connecting = 0;
+    }
+
+    while (1) {
+        n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            w->bytes += n;
+            if (parse_responses(w, c, buf, n) == -1) {
+                conn_reopen(w, c);
+                return;
+            }
+            continue;
+        }
+        if (n == 0) {
+            // 对端关闭连接，没有收到响应的请求在新连接上重新发送
+            if (c->npending > 0 && !c->close_after)
+                w->read_errors++;
+            conn_reopen(w, c);
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            w->read_errors++;
+            conn_reopen(w, c);
+            return;
+        }
+        break;
+    }
+
+    fill_requests(c, now_us());
+    if (flush_writes(c) == -1) {
+        w->read_errors++;
+        conn_reopen(w, c);
+    }
+}
+
+// 按固定速率发送时最早到期的请求的计划时间，没有可以发送的连接时返回0
+static uint64_t next_due(worker *w){
+    uint64_t due = 0;
+
+    for (int i = 0; i < w->nconns; i++) {
+        bench_conn *c = &w->conns[i];
+        if (c->connecting || c->npending >= depth)
+            continue;
+        if (due == 0 || c->next_send < due)
+            due = c->next_send;
+    }
+    return due;
+}
+
+static void* worker_main(void *arg){
+    worker *w = arg;
+    struct epoll_event events[256];
+    struct timespec ts;
+    uint64_t now, due, wait;
+    int n;
+
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 0; i < w->nconns; i++) {
+        // 各连接的发送时间错开，避免同时发送
+        w->conns[i].next_send = start_us + (rate > 0 ? (uint64_t) (i * nthreads + w->id) * 1e6 / rate : 0);
+        conn_open(w, &w->conns[i]);
+    }
+
+    while (1) {
+        now = now_us();
+        if (now >= end_us)
+            break;
+
+        // 按固定速率发送时精确地等到下一个请求到期，避免等待本身计入延迟
+        wait = 100000;
+        if (rate > 0 && (due = next_due(w)) != 0)
+            wait = due > now ? due - now : 0;
+        if (wait > end_us - now)
+            wait = end_us - now;
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = wait % 1000000 * 1000;
+
+        n = epoll_pwait2(w->epfd, events, 256, &ts, NULL);
+
+        for (int i = 0; i < n; i++)
+            handle_event(w, events[i].data.ptr, events[i].events);
+
+        if (rate > 0) {
+            now = now_us();
+            for (int i = 0; i < w->nconns; i++) {
+                bench_conn *c = &w->conns[i];
+                if (c->connecting || c->next_send > now || c->npending >= depth)
+                    continue;
+                fill_requests(c, now);
+                if (flush_writes(c) == -1) {
+                    w->read_errors++;
+                    conn_reopen(w, c);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) {
+        close(w->conns[i].fd);
+        free(w->conns[i].wbuf);
+    }
+    close(w->epfd);
+    return NULL;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+            "usage: %s [options] [host:]port\n"
+            "  -c <n>     concurrent connections (default 64)\n"
+            "  -t <n>     threads (default 2)\n"
+            "  -d <sec>   duration in seconds (default 10)\n"
+            "  -p <n>     pipelined requests per connection (default 1, max %d)\n"
+            "  -R <rps>   send at a constant total rate; latency is measured from the\n"
+            "             scheduled send time (default: as fast as possible)\n"
+            "  -K         disable keep-alive, one request per connection\n"
+            "  -u <uri>   request this URI, may be repeated (default /)\n"
+            "  -l <file>  replay the GET URIs from an access log written by web\n",
+            prog, PIPELINE_MAX);
+    exit(1);
+}
+
+static void parse_target(const char *arg){
+    char host[256] = "127.0.0.1";
+    const char *colon = strrchr(arg, ':');
+    struct addrinfo hints, *res;
+    int port;
+
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - arg), arg);
+        port = atoi(colon + 1);
+    } else {
+        port = atoi(arg);
+    }
+
+    if (port <= 0 || port > 65535)
+        usage("webbench");
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        fprintf(stderr, "cannot resolve %s\n", host);
+        exit(1);
+    }
+
+    memcpy(&target, res->ai_addr, sizeof(target));
+    target.sin_port = htons(port);
+    freeaddrinfo(res);
+    snprintf(host_header, sizeof(host_header), "%s:%d", host, port);
+}
+
+static void print_percentiles(const char *title, const histogram *h){
+    static const double ps[] = {50, 90, 99, 99.9};
+
+    printf("  %s\n", title);
+    for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++)
+        printf("    p%-6g %10.3f ms\n", ps[i], hist_percentile(h, ps[i]) / 1e3);
+    printf("    max     %10.3f ms\n", h->max / 1e3);
+    printf("    mean    %10.3f ms\n", h->total ? h->sum / h->total / 1e3 : 0);
+}
+
+int main(int argc, char **argv) {
+    histogram service, latency, corrected;
+    uint64_t requests = 0, bytes = 0, status[6] = {0};
+    uint64_t connect_errors = 0, read_errors = 0, reconnects = 0;
+    worker *workers;
+    double secs;
+    int opt, k = 0;
+
+    while ((opt = getopt(argc, argv, "c:t:d:p:R:Ku:l:")) != -1) {
+        switch (opt) {
+            case 'c': nconns = atoi(optarg); break;
+            case 't': nthreads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'p': depth = atoi(optarg); break;
+            case 'R': rate = atof(optarg); break;
+            case 'K': keepalive = 0; break;
+            case 'u': add_uri(optarg, strlen(optarg)); break;
+            case 'l': load_access_log(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || nconns <= 0 || nthreads <= 0 || duration <= 0 ||
+        depth <= 0 || depth > PIPELINE_MAX || rate < 0)
+        usage(argv[0]);
+    parse_target(argv[optind]);
+
+    if (nuris == 0)
+        add_uri("/", 1);
+    if (nthreads > nconns)
+        nthreads = nconns;
+    if (!keepalive)
+        depth = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("running %ds test @ %s, %d threads, %d connections, pipeline %d, %s, %zu URIs",
+           duration, host_header, nthreads, nconns, depth, keepalive ? "keep-alive" : "close", nuris);
+    if (rate > 0)
+        printf(", %.0f req/s", rate);
+    printf("\n");
+
+    start_us = now_us();
+    end_us = start_us + (uint64_t) duration * 1000000;
+
+    workers = calloc(nthreads, sizeof(*workers));
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        workers[i].conns = calloc(workers[i].nconns, sizeof(bench_conn));
+        k += workers[i].nconns;
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+
+    memset(&service, 0, sizeof(service));
+    memset(&latency, 0, sizeof(latency));
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        hist_merge(&service, &workers[i].service);
+        hist_merge(&latency, &workers[i].latency);
+        requests += workers[i].requests;
+        bytes += workers[i].bytes;
+        for (int s = 0; s < 6; s++)
+            status[s] += workers[i].status[s];
+        connect_errors += workers[i].connect_errors;
+        read_errors += workers[i].read_errors;
+        reconnects += workers[i].reconnects;
+        free(workers[i].conns);
+    }
+
+    secs = (end_us - start_us) / 1e6;
+    printf("  requests  %llu in %.1fs, %.1f req/s, %.2f MB/s\n",
+           (unsigned long long) requests, secs, requests / secs, bytes / secs / 1048576);
+    printf("  status    2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+           (unsigned long long) status[2], (unsigned long long) status[3],
+           (unsigned long long) status[4], (unsigned long long) status[5],
+           (unsigned long long) (status[0] + status[1]));
+    printf("  errors    connect %llu, read %llu, reconnects %llu\n",
+           (unsigned long long) connect_errors, (unsigned long long) read_errors,
+           (unsigned long long) reconnects);
+
+    if (requests == 0)
+        return 1;
+
+    if (rate > 0) {
+        // 按计划时间计算的延迟本身已经包含了因排队而推迟发送的时间
+        print_percentiles("latency (from scheduled send time, corrected for coordinated omission)", &latency);
+        print_percentiles("service time (from actual send time)", &service);
+    } else {
+        // 没有指定速率时，每个连接的预期请求间隔为平均每个请求占用连接的时间
+        hist_correct(&corrected, &service, (uint64_t) (secs * 1e6 * k / requests));
+        print_percentiles("latency (corrected for coordinated omission)", &corrected);
+        print_percentiles("latency (uncorrected)", &service);
+    }
+
+    return 0;
+}